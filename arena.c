@@ -0,0 +1,142 @@
+/* Chunked bump allocator
+ *
+ * Everything allocated in an arena dies at the same time, so
+ * allocation is a pointer increment and freeing is a walk over a
+ * handful of chunks.
+ *
+ * Since the point of niffy is to run NIFs under valgrind, we tell
+ * memcheck about each allocation and leave a redzone between them, so
+ * overruns of one term into the next are still caught.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#ifdef HAVE_VALGRIND
+#include <valgrind/memcheck.h>
+#else
+#define RUNNING_ON_VALGRIND 0
+#define VALGRIND_MAKE_MEM_NOACCESS(p, n) ((void)(p), (void)(n))
+#define VALGRIND_MAKE_MEM_UNDEFINED(p, n) ((void)(p), (void)(n))
+#endif
+
+enum {
+    ALIGNMENT = 8,
+    REDZONE = 16,
+    MIN_CHUNK_SIZE = 16384,
+    MAX_CHUNK_SIZE = 1<<20,
+    BIG_ALLOCATION = MAX_CHUNK_SIZE/4
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    char data[] __attribute__((aligned(ALIGNMENT)));
+};
+
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+    struct arena_chunk *c = malloc(sizeof(*c) + size);
+    if (NULL == c)
+        return NULL;
+    c->next = NULL;
+    c->size = size;
+    VALGRIND_MAKE_MEM_NOACCESS(c->data, size);
+    return c;
+}
+
+
+static void *alloc_slow(struct arena *a, size_t size)
+{
+    struct arena_chunk *c;
+
+    /* Large allocations get a chunk of their own, tucked behind the
+     * current one so we don't waste what's left of it. */
+    if (size >= BIG_ALLOCATION && a->chunks) {
+        if (NULL == (c = new_chunk(size)))
+            return NULL;
+        c->next = a->chunks->next;
+        a->chunks->next = c;
+        return c->data;
+    }
+
+    size_t chunk_size = MIN_CHUNK_SIZE;
+    if (a->chunks && a->chunks->size < MAX_CHUNK_SIZE)
+        chunk_size = a->chunks->size * 2;
+    else if (a->chunks)
+        chunk_size = MAX_CHUNK_SIZE;
+    while (chunk_size < size)
+        chunk_size *= 2;
+
+    if (NULL == (c = new_chunk(chunk_size)))
+        return NULL;
+    c->next = a->chunks;
+    a->chunks = c;
+    a->next = c->data + size;
+    a->limit = c->data + chunk_size;
+    return c->data;
+}
+
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size_t padded = (size + ALIGNMENT-1) & ~(size_t)(ALIGNMENT-1);
+    if (RUNNING_ON_VALGRIND)
+        padded += REDZONE;
+    if (0 == padded)
+        padded = ALIGNMENT;
+
+    void *p;
+    if ((size_t)(a->limit - a->next) >= padded) {
+        p = a->next;
+        a->next += padded;
+    } else if (NULL == (p = alloc_slow(a, padded)))
+        return NULL;
+    a->used += padded;
+    VALGRIND_MAKE_MEM_UNDEFINED(p, size);
+    return p;
+}
+
+
+size_t arena_used(const struct arena *a)
+{
+    return a->used;
+}
+
+
+/* Frees everything but the most recent chunk, which is kept for
+ * reuse (unless it's oversized); environments that are cleared
+ * repeatedly then settle into never calling malloc. */
+void arena_clear(struct arena *a)
+{
+    if (NULL == a->chunks)
+        return;
+    if (a->chunks->size > MAX_CHUNK_SIZE) {
+        arena_destroy(a);
+        return;
+    }
+    struct arena_chunk *keep = a->chunks;
+    for (struct arena_chunk *c = keep->next, *n; c; c = n) {
+        n = c->next;
+        free(c);
+    }
+    keep->next = NULL;
+    a->used = 0;
+    a->next = keep->data;
+    a->limit = keep->data + keep->size;
+    VALGRIND_MAKE_MEM_NOACCESS(keep->data, keep->size);
+}
+
+
+void arena_destroy(struct arena *a)
+{
+    for (struct arena_chunk *c = a->chunks, *n; c; c = n) {
+        n = c->next;
+        free(c);
+    }
+    *a = (struct arena){0};
+}
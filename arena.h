@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunks;
+    char *next, *limit;
+    size_t used;
+};
+
+extern void *arena_alloc(struct arena *, size_t);
+extern void arena_clear(struct arena *);
+extern size_t arena_used(const struct arena *);
+extern void arena_destroy(struct arena *);
@@ -1,21 +1,40 @@
 /* Symbol table.
  *
- * Braindead -- simplest hash table possible.
+ * Names are hashed with wyhash and found through a power-of-two Robin
+ * Hood table, which keeps probe sequences short even when it's nearly
+ * full.  Each slot keeps 32 bits of the hash, so a probe only touches
+ * a name when the hashes match.
+ *
+ * Names live in an arena, each as a struct str, and are never freed
+ * before exit, so symbol_name can hand out pointers into it.  NIF
+ * threads make atoms too, so it's all behind a lock.
  */
 
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "atom.h"
 
+typedef uint64_t hash;
+
+struct slot {
+    uint32_t hash;
+    atom sym;                   /* 0 if empty */
+};
+
+static struct arena names;
 static const struct str **string_of_atom;
+static size_t string_of_atom_allocated;
 static atom symbol_counter;
 
-typedef uint32_t hash;
+/* Grow past 7/8ths full. */
 static size_t allocated, n_entries;
-static atom *table;
+static struct slot *table;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 __attribute__((constructor))
 static void init(void)
@@ -24,7 +43,8 @@ static void init(void)
     n_entries = 0;
     table = calloc(allocated, sizeof(*table));
     assert(table);
-    string_of_atom = malloc((1+allocated) * sizeof(*string_of_atom));
+    string_of_atom_allocated = allocated;
+    string_of_atom = malloc(string_of_atom_allocated * sizeof(*string_of_atom));
     assert(string_of_atom);
 }
 
@@ -33,100 +53,187 @@ __attribute__((destructor))
 static void shutdown(void)
 {
     free(table);
-    for (unsigned i = 1; i <= n_entries; ++i)
-        str_free((struct str **)&string_of_atom[i]);
     free(string_of_atom);
+    arena_destroy(&names);
 }
 
 
-static hash hash_of_string(const struct str *s)
+/* wyhash, by Wang Yi (public domain). */
+static uint64_t mum(uint64_t a, uint64_t b)
 {
-    hash v = 0;
-    for (size_t i = 0; i < s->len; ++i)
-        v += s->data[i] * 31;
-    return v;
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint64_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static hash hash_of_bytes(const char *bytes, size_t len)
+{
+    static const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull,
+        s2 = 0x8ebc6af09c88c6dbull, s3 = 0x589965cc75374cc3ull;
+    const uint8_t *p = (const uint8_t *)bytes;
+    uint64_t seed = mum(s0, s1), a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = read32(p) << 32 | read32(p + ((len >> 3) << 2));
+            b = read32(p+len-4) << 32 | read32(p+len-4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len-1];
+            b = 0;
+        } else
+            a = b = 0;
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mum(read64(p) ^ s1, read64(p+8) ^ seed);
+                see1 = mum(read64(p+16) ^ s2, read64(p+24) ^ see1);
+                see2 = mum(read64(p+32) ^ s3, read64(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        for (; i > 16; i -= 16, p += 16)
+            seed = mum(read64(p) ^ s1, read64(p+8) ^ seed);
+        a = read64(p+i-16);
+        b = read64(p+i-8);
+    }
+    __uint128_t r = (__uint128_t)(a ^ s1) * (b ^ seed);
+    return mum((uint64_t)r ^ s0 ^ len, (uint64_t)(r >> 64) ^ s1);
+}
+
+
+static size_t distance(size_t i, uint32_t h)
+{
+    return (i - h) & (allocated - 1);
+}
+
+
+/* Robin Hood: whoever is further from home keeps the slot, and the
+ * other carries on. */
+static void place(struct slot *t, struct slot s)
+{
+    size_t mask = allocated - 1;
+    for (size_t i = s.hash & mask, d = 0;; i = (i+1) & mask, ++d) {
+        if (0 == t[i].sym) {
+            t[i] = s;
+            return;
+        }
+        size_t theirs = distance(i, t[i].hash);
+        if (theirs < d) {
+            struct slot tmp = t[i];
+            t[i] = s;
+            s = tmp;
+            d = theirs;
+        }
+    }
 }
 
 
 static void grow(void)
 {
     size_t original_size = allocated;
+    struct slot *old = table;
     allocated <<= 1;
-    atom *new = calloc(allocated, sizeof(*table));
-    for (size_t i = 0; i < original_size; ++i) {
-        atom sym = table[i];
-        if (sym) {
-            assert(sym <= symbol_counter);
-            hash h = hash_of_string(string_of_atom[sym]) % allocated, o = h;
-            while (new[h] && ++h != o)
-                h %= allocated;
-            assert(!new[h]);
-            new[h] = sym;
+    table = calloc(allocated, sizeof(*table));
+    assert(table);
+    for (size_t i = 0; i < original_size; ++i)
+        if (old[i].sym)
+            place(table, old[i]);
+    free(old);
+}
+
+
+static atom lookup(const char *bytes, size_t len, hash h)
+{
+    size_t mask = allocated - 1;
+    for (size_t i = (uint32_t)h & mask, d = 0;; i = (i+1) & mask, ++d) {
+        struct slot s = table[i];
+        /* Past where it would have been placed. */
+        if (0 == s.sym || distance(i, s.hash) < d)
+            return 0;
+        if (s.hash == (uint32_t)h) {
+            const struct str *name = string_of_atom[s.sym];
+            if (name->len == len && 0 == memcmp(name->data, bytes, len))
+                return s.sym;
         }
     }
-    free(table);
-    table = new;
-    typeof(string_of_atom) tmp =
-        realloc(string_of_atom, (1+allocated) * sizeof(*string_of_atom));
-    assert(tmp != NULL);
-    string_of_atom = tmp;
-    assert(string_of_atom);
 }
 
 
-static void insert(const struct str *s, hash h, atom sym)
+static atom insert(const char *bytes, size_t len, hash h)
 {
-    if (n_entries >= allocated)
+    struct str *name = arena_alloc(&names, sizeof(*name) + len);
+    assert(name);
+    name->len = name->avail = len;
+    memcpy(name->data, bytes, len);
+
+    atom sym = ++symbol_counter;
+    if (sym >= string_of_atom_allocated) {
+        string_of_atom_allocated <<= 1;
+        typeof(string_of_atom) tmp =
+            realloc(string_of_atom, string_of_atom_allocated * sizeof(*string_of_atom));
+        assert(tmp != NULL);
+        string_of_atom = tmp;
+    }
+    string_of_atom[sym] = name;
+
+    if (8 * (n_entries+1) > 7 * allocated)
         grow();
-    while (table[h % allocated])
-        ++h;
-    table[h % allocated] = sym;
+    place(table, (struct slot){.hash = (uint32_t)h, .sym = sym});
     ++n_entries;
-    string_of_atom[sym] = s;
+    return sym;
 }
 
 
-static atom lookup(const struct str *s, hash h_orig)
+atom intern_bytes(const char *bytes, size_t len)
 {
-    atom sym = 0;
-    h_orig %= allocated;
-    hash h = h_orig;
-    while ((sym = table[h])) {
-        if (str_eq(s, string_of_atom[sym]))
-            return sym;
-        h = (h+1) % allocated;
-        if (h == h_orig)
-            return 0;
-    }
-    return 0;
+    hash h = hash_of_bytes(bytes, len);
+    pthread_mutex_lock(&lock);
+    atom sym = lookup(bytes, len, h);
+    if (0 == sym)
+        sym = insert(bytes, len, h);
+    pthread_mutex_unlock(&lock);
+    return sym;
+}
+
+
+/* 0 if there's no such atom. */
+atom lookup_atom(const char *bytes, size_t len)
+{
+    hash h = hash_of_bytes(bytes, len);
+    pthread_mutex_lock(&lock);
+    atom sym = lookup(bytes, len, h);
+    pthread_mutex_unlock(&lock);
+    return sym;
 }
 
 
 atom intern(const struct str *name)
 {
-    hash h = hash_of_string(name);
-    atom sym = lookup(name, h);
-    if (sym != 0) {
-        str_free((struct str **)&name);
-        return sym;
-    }
-    sym = ++symbol_counter;
-    insert(name, h, sym);
+    atom sym = intern_bytes(name->data, name->len);
+    str_free((struct str **)&name);
     return sym;
 }
 
 
 atom intern_cstr(const char *name)
 {
-    return intern(str_dup_cstr(name));
+    return intern_bytes(name, strlen(name));
 }
 
 
 const struct str *symbol_name(atom sym)
 {
-    if (sym < 1 || sym > symbol_counter)
-        return NULL;
-    return string_of_atom[sym];
+    const struct str *name = NULL;
+    pthread_mutex_lock(&lock);
+    if (sym >= 1 && sym <= symbol_counter)
+        name = string_of_atom[sym];
+    pthread_mutex_unlock(&lock);
+    return name;
 }
 
 
@@ -144,7 +251,7 @@ static bool atom_must_be_quoted_p(const struct str *name)
     for (unsigned i = 1; i < name->len; ++i)
         if (name->data[i] != '@' &&
             name->data[i] != '_' &&
-            !isalpha(name->data[i]))
+            !isalnum(name->data[i]))
             return true;
 
     return false;
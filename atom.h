@@ -8,6 +8,8 @@
 typedef uint32_t atom;
 
 extern atom intern(const struct str *);
+extern atom intern_bytes(const char *, size_t);
 extern atom intern_cstr(const char *);
+extern atom lookup_atom(const char *, size_t);
 extern const struct str *symbol_name(atom);
 extern void pretty_print_atom(FILE *, atom);
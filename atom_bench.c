@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "atom.h"
+#include "histogram.h"
+
+
+static void report(const char *what, unsigned long n, uint64_t ns)
+{
+    printf("%-24s %10lu %8.1f ns/op %12.0f ops/sec\n", what, n,
+           (double)ns / n, n / (ns / 1e9));
+}
+
+
+/* intern N distinct atoms, then intern them all again, then look up
+ * their names; prints time per operation for each */
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    char (*names)[32] = malloc(n * sizeof(*names));
+    atom *atoms = malloc(n * sizeof(*atoms));
+    if (NULL == names || NULL == atoms)
+        abort();
+    for (unsigned long i = 0; i < n; ++i)
+        snprintf(names[i], sizeof(*names), "atom_%lu", i);
+
+    uint64_t start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+        atoms[i] = intern_cstr(names[i]);
+    report("intern (new)", n, monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+        if (intern_cstr(names[i]) != atoms[i])
+            abort();
+    report("intern (existing)", n, monotonic_ns() - start);
+
+    size_t total = 0;
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+        total += symbol_name(atoms[i])->len;
+    report("symbol_name", n, monotonic_ns() - start);
+
+    free(atoms);
+    free(names);
+    return 0 == total;
+}
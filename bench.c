@@ -0,0 +1,107 @@
+/* Micro-benchmarks of single NIF calls
+ *
+ * The call is made over and over with the same arguments, in an env of
+ * its own that's cleared between calls (outside the timed region), so
+ * what we measure is the NIF and not the interpreter around it.
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "histogram.h"
+#include "niffy.h"
+#include "process.h"
+
+static struct enif_environment_t bench_env;
+
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Calls f n times, after a warmup of a tenth as many (to get caches,
+ * branch predictors and the allocator into their steady state).  The
+ * result of the last call is copied into result_env. */
+bool bench(struct fptr *f, unsigned argc, const term argv[], unsigned long n,
+           ErlNifEnv *result_env, term *result, struct bench_stats *stats)
+{
+    enum { MAX_WARMUP = 10000 };
+    uint64_t *samples = malloc(n * sizeof(*samples));
+    if (0 == n || NULL == samples) {
+        free(samples);
+        return false;
+    }
+
+    bench_env.process = process_main();
+    unsigned long warmup = n/10 < MAX_WARMUP ? n/10 : MAX_WARMUP;
+    for (unsigned long i = 0; i < warmup; ++i) {
+        niffy_invoke_in(&bench_env, f, argc, argv);
+        enif_clear_env(&bench_env);
+    }
+
+    uint64_t total = 0;
+    term last = 0;
+    for (unsigned long i = 0; i < n; ++i) {
+        uint64_t start = monotonic_ns();
+        last = niffy_invoke_in(&bench_env, f, argc, argv);
+        samples[i] = monotonic_ns() - start;
+        total += samples[i];
+        if (i+1 < n)
+            enif_clear_env(&bench_env);
+    }
+    if (result)
+        *result = enif_make_copy(result_env, last);
+    enif_clear_env(&bench_env);
+
+    qsort(samples, n, sizeof(*samples), compare_u64);
+    *stats = (struct bench_stats){
+        .calls = n,
+        .min_ns = samples[0],
+        .median_ns = samples[(n-1)/2],
+        .p99_ns = samples[(n*99 + 99)/100 - 1],
+        .max_ns = samples[n-1],
+        .ns_per_call = (double)total / n,
+        .calls_per_sec = total ? 1e9 * n / total : 0
+    };
+    free(samples);
+    return true;
+}
+
+
+term bench_stats_term(ErlNifEnv *env, const struct bench_stats *s)
+{
+    term pair(const char *key, term v) {
+        return enif_make_tuple(env, 2, enif_make_atom(env, key), v);
+    }
+    return enif_make_list(env, 7,
+                          pair("calls", enif_make_ulong(env, s->calls)),
+                          pair("min_ns", enif_make_ulong(env, s->min_ns)),
+                          pair("median_ns", enif_make_ulong(env, s->median_ns)),
+                          pair("p99_ns", enif_make_ulong(env, s->p99_ns)),
+                          pair("max_ns", enif_make_ulong(env, s->max_ns)),
+                          pair("ns_per_call", enif_make_double(env, s->ns_per_call)),
+                          pair("calls_per_sec", enif_make_double(env, s->calls_per_sec)));
+}
+
+
+void bench_print(FILE *out, struct fptr *f, const struct bench_stats *s)
+{
+    niffy_print_mfa(out, f);
+    fprintf(out, ": %lu calls, min %lu ns, median %lu ns, p99 %lu ns, max %lu ns, "
+            "%.1f ns/call, %.0f calls/s\n",
+            s->calls, (unsigned long)s->min_ns, (unsigned long)s->median_ns,
+            (unsigned long)s->p99_ns, (unsigned long)s->max_ns,
+            s->ns_per_call, s->calls_per_sec);
+}
+
+
+/* bench_env is always cleared after use, so there's nothing in it
+ * that needs its NIF still loaded. */
+__attribute__((destructor))
+static void bench_destroy(void)
+{
+    arena_destroy(&bench_env.heap);
+}
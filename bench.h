@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nif_stubs.h"
+
+struct fptr;
+
+struct bench_stats {
+    unsigned long calls;
+    uint64_t min_ns, median_ns, p99_ns, max_ns;
+    double ns_per_call, calls_per_sec;
+};
+
+extern bool bench(struct fptr *, unsigned, const term[], unsigned long,
+                  ErlNifEnv *, term *, struct bench_stats *);
+extern term bench_stats_term(ErlNifEnv *, const struct bench_stats *);
+extern void bench_print(FILE *, struct fptr *, const struct bench_stats *);
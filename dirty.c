@@ -0,0 +1,193 @@
+/* Dirty schedulers
+ *
+ * Functions flagged ERL_NIF_DIRTY_JOB_CPU_BOUND or _IO_BOUND (or
+ * continued with those flags by enif_schedule_nif) run on one of two
+ * thread pools, sized by default as ERTS sizes them: a dirty CPU
+ * thread per online CPU, and ten dirty IO threads.  The caller blocks
+ * until the job is done, just as the calling process would.
+ *
+ * The pools are started along with niffy, so that starting them isn't
+ * timed as part of the first dirty call (or on first use, for anything
+ * that doesn't start them itself).  With --counters, each worker
+ * opens its own group of counters when it's first given a job to count,
+ * and counts the job on those, since the caller's are idle meanwhile.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dirty.h"
+
+enum { DEFAULT_DIRTY_IO_THREADS = 10 };
+
+struct job {
+    term (*fptr)(ErlNifEnv *, int, const term[]);
+    ErlNifEnv *env;
+    int argc;
+    const term *argv;
+    term result;
+    /* Where to add what the job counted, or NULL. */
+    struct perf_sample *counts;
+    bool done_p;
+    pthread_cond_t done;
+    struct job *next;
+};
+
+struct pool {
+    const char *name;
+    unsigned size;
+    pthread_t *threads;
+    unsigned n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct job *head, **tail;
+    bool stopping_p;
+};
+
+static struct pool cpu_pool = {
+    .name = "dirty CPU",
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .tail = &cpu_pool.head
+};
+static struct pool io_pool = {
+    .name = "dirty IO",
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .tail = &io_pool.head
+};
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+
+
+
+bool dirty_p(int flags)
+{
+    return flags & (ERL_NIF_DIRTY_JOB_CPU_BOUND | ERL_NIF_DIRTY_JOB_IO_BOUND);
+}
+
+
+static void *worker(void *arg)
+{
+    struct pool *pool = arg;
+    bool counting_p = false, tried_counting_p = false;
+    on_dirty_scheduler_p = true;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (NULL == pool->head && !pool->stopping_p)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (NULL == pool->head)
+            break;
+        struct job *job = pool->head;
+        if (NULL == (pool->head = job->next))
+            pool->tail = &pool->head;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct perf_sample before, after;
+        if (job->counts && !tried_counting_p) {
+            tried_counting_p = true;
+            counting_p = perf_open();
+        }
+        if (job->counts && counting_p)
+            perf_read(&before);
+        job->result = job->fptr(job->env, job->argc, job->argv);
+        if (job->counts && counting_p) {
+            perf_read(&after);
+            perf_add(job->counts, &before, &after);
+        } else if (job->counts)
+            /* As if multiplexed out throughout, so it's not counted. */
+            ++job->counts->enabled;
+
+        pthread_mutex_lock(&pool->lock);
+        job->done_p = true;
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (counting_p)
+        perf_close();
+    return NULL;
+}
+
+
+static void start_pool(struct pool *pool, unsigned default_size)
+{
+    unsigned n = pool->size ? pool->size : default_size;
+    if (NULL == (pool->threads = calloc(n, sizeof(*pool->threads))))
+        abort();
+    for (; pool->n_threads < n; ++pool->n_threads) {
+        if (0 != pthread_create(&pool->threads[pool->n_threads], NULL, worker, pool)) {
+            fprintf(stderr, "couldn't start %s thread\n", pool->name);
+            abort();
+        }
+    }
+}
+
+
+static void start_pools(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    start_pool(&cpu_pool, n_cpus > 0 ? n_cpus : 1);
+    start_pool(&io_pool, DEFAULT_DIRTY_IO_THREADS);
+}
+
+
+/* Zero leaves a pool at its default size.  Only has an effect before
+ * the first dirty call. */
+void dirty_start(unsigned n_cpu, unsigned n_io)
+{
+    cpu_pool.size = n_cpu;
+    io_pool.size = n_io;
+    pthread_once(&start_once, start_pools);
+}
+
+
+/* Runs fptr on a dirty scheduler, adding what it counted to counts
+ * unless that's NULL. */
+term dirty_call(int flags, term (*fptr)(ErlNifEnv *, int, const term[]),
+                ErlNifEnv *env, int argc, const term argv[],
+                struct perf_sample *counts)
+{
+    assert(dirty_p(flags));
+    pthread_once(&start_once, start_pools);
+    struct pool *pool = flags & ERL_NIF_DIRTY_JOB_CPU_BOUND ? &cpu_pool : &io_pool;
+    struct job job = {.fptr = fptr, .env = env, .argc = argc, .argv = argv,
+                      .counts = counts};
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    *pool->tail = &job;
+    pool->tail = &job.next;
+    pthread_cond_signal(&pool->work);
+    while (!job.done_p)
+        pthread_cond_wait(&job.done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_cond_destroy(&job.done);
+    return job.result;
+}
+
+
+static void stop_pool(struct pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping_p = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->n_threads; ++i)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->n_threads = 0;
+}
+
+
+/* The workers run NIF code, so this must be called before unloading
+ * anything. */
+void dirty_stop(void)
+{
+    stop_pool(&cpu_pool);
+    stop_pool(&io_pool);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "nif_stubs.h"
+#include "perf.h"
+
+extern void dirty_start(unsigned, unsigned);
+extern bool dirty_p(int);
+extern term dirty_call(int, term (*)(ErlNifEnv *, int, const term[]),
+                       ErlNifEnv *, int, const term[],
+                       struct perf_sample *);
+extern void dirty_stop(void);
@@ -1,34 +1,49 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "niffy.h"
-#include "lex.h"
-#include "parse_protos.h"
+#include "macrology.h"
+#include "process.h"
+#include "program.h"
+#include "str.h"
+#include "variable.h"
 
 
-static void process(struct lexer *lexer, void *parser, char *input)
+/* The term file is compiled once and replayed against every input. */
+static struct str *template;
+static struct program *program;
+static atom input_atom;
+/* niffy keeps pointers to the .so paths, so this outlives setup. */
+static char *nif_list;
+
+
+static bool read_template(const char *path)
 {
-    lex_setup_next_line(lexer, input, strlen(input), true);
-    struct token token;
-    while (lex(lexer, &token))
-        Parse(parser, token.type, token, niffy_handle_statement);
+    FILE *in = fopen(path, "r");
+    if (NULL == in)
+        return false;
+    char buf[4096];
+    size_t len;
+    template = str_new(sizeof(buf));
+    while ((len = fread(buf, 1, sizeof(buf), in)))
+        if (!str_append_bytes(&template, buf, len))
+            abort();
+    bool ok = !ferror(in);
+    fclose(in);
+    return ok;
 }
 
 
-int main(int argc, char **argv)
+static bool setup(int n_sos, char **sos, const char *template_path)
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage:\n  %s <NIF .so>... <term file>\n\n", argv[0]);
-        fprintf(stderr, "The variable Input will be bound to a binary "
-                "constructed from stdin before the term file is read.\n");
-        return 1;
-    }
     niffy_construct_erlang_env();
     niffy_construct_assert_env();
     /* Beware!  In a (well-meaning) attempt to speed up fuzzing,
@@ -40,46 +55,138 @@ int main(int argc, char **argv)
      * Set LD_BIND_LAZY in your environment before running afl-fuzz,
      * unless you know niffy implements everything your NIF
      * references. */
-    for (int i = 1; i < (argc - 1); ++i)
-        assert(niffy_load_so(argv[i], RTLD_LAZY, 0));
-    FILE *in = fopen(argv[argc - 1], "r");
-    assert(in);
+    for (int i = 0; i < n_sos; ++i)
+        if (!niffy_load_so(sos[i], RTLD_LAZY, 0))
+            return false;
+    if (!read_template(template_path)) {
+        perror(template_path);
+        return false;
+    }
+    input_atom = intern_cstr("Input");
+    program = program_compile(template->data, template->len);
+    return NULL != program;
+}
 
-    struct lexer lexer;
-    lex_init(&lexer);
-    void *pParser;
 
-    pParser = ParseAlloc(malloc);
+/* Takes over input.  Everything but the loaded NIFs is reset
+ * afterwards, so each run starts from the same state. */
+static void run(ErlNifBinary *input)
+{
+    assert(variable_assign(input_atom, enif_make_binary(NULL, input)));
+    enif_clear_env(NULL);
+    program_run(program);
+    variable_destroy();
+    process_drain(process_main());
+}
 
-    process(&lexer, pParser, "Input = <<");
 
-    bool is_first = true;
-    char buf_in[4096], buf_out[5*sizeof(buf_in)+1];
-    size_t len;
-    while ((len = fread(buf_in, 1, sizeof(buf_in), stdin))) {
-        char *p = buf_in, *q = buf_out;
-        if (is_first) {
-            q += snprintf(q, 4, "%hhu", (uint8_t)*p++);
-            is_first = false;
-        }
-        while (p < buf_in+len)
-            q += snprintf(q, 5, ",%hhu", (uint8_t)*p++);
-        *q = 0;
-        assert(q < buf_out+sizeof(buf_out));
-        process(&lexer, pParser, buf_out);
+static void teardown(void)
+{
+    program_free(program);
+    str_free(&template);
+    niffy_destroy_environments();
+    free(nif_list);
+}
+
+
+/* Reads all of fd straight into a binary; going through the term
+ * parser would mean fuzzing niffy more than the NIF. */
+static bool read_input(int fd, ErlNifBinary *bin)
+{
+    struct stat st;
+    size_t avail = 4096, len = 0;
+    if (0 == fstat(fd, &st) && S_ISREG(st.st_mode))
+        avail = st.st_size + 1;
+    if (!enif_alloc_binary(avail, bin))
+        return false;
+    for (;;) {
+        if (len == avail && !enif_realloc_binary(bin, avail *= 2))
+            goto fail;
+        ssize_t n = read(fd, bin->data + len, avail - len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n < 0)
+            goto fail;
+        if (0 == n)
+            break;
+        len += n;
     }
+    return enif_realloc_binary(bin, len);
 
-    process(&lexer, pParser, ">>.\n");
+fail:
+    enif_release_binary(bin);
+    return false;
+}
 
-    /* Read the rest from the supplied file */
-    char *line = NULL;
-    size_t line_len = 0;
-    while (-1 != getline(&line, &line_len, in))
-        process(&lexer, pParser, line);
-    Parse(pParser, 0, (struct token){.type = 0, .location = lexer.location},
-          niffy_handle_statement);
 
-    ParseFree(pParser, free);
-    niffy_destroy_environments();
+#ifdef NIFFY_LIBFUZZER
+
+/* libFuzzer owns argv, so the NIFs (colon-separated) and the term file
+ * come from the environment. */
+int LLVMFuzzerInitialize(int *UNUSED, char ***UNUSED)
+{
+    const char *nifs = getenv("NIFFY_FUZZ_NIFS"),
+        *template_path = getenv("NIFFY_FUZZ_TEMPLATE");
+    if (!nifs || !template_path) {
+        fprintf(stderr, "Set NIFFY_FUZZ_NIFS to a colon-separated list of "
+                "NIF .so files and NIFFY_FUZZ_TEMPLATE to a term file.\n");
+        exit(1);
+    }
+    char *sos[64], *saveptr = NULL;
+    int n_sos = 0;
+    nif_list = strdup(nifs);
+    for (char *so = strtok_r(nif_list, ":", &saveptr);
+         so && n_sos < (int)(sizeof(sos)/sizeof(*sos));
+         so = strtok_r(NULL, ":", &saveptr))
+        sos[n_sos++] = so;
+    if (!setup(n_sos, sos, template_path))
+        exit(1);
+    atexit(teardown);
+    return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    ErlNifBinary input;
+    if (!enif_alloc_binary(size, &input))
+        abort();
+    memcpy(input.data, data, size);
+    run(&input);
     return 0;
 }
+
+#else
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage:\n  %s <NIF .so>... <term file>\n\n", argv[0]);
+        fprintf(stderr, "The variable Input will be bound to a binary "
+                "constructed from stdin before the term file is read.\n");
+        return 1;
+    }
+    if (!setup(argc - 2, argv + 1, argv[argc - 1]))
+        return 1;
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+    /* Fork after the NIFs are loaded, and with afl-clang-fast, loop
+     * over inputs without forking at all. */
+    __AFL_INIT();
+    while (__AFL_LOOP(10000)) {
+#endif
+        ErlNifBinary input;
+        if (!read_input(STDIN_FILENO, &input)) {
+            perror("reading input");
+            return 1;
+        }
+        run(&input);
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+    }
+#endif
+
+    teardown();
+    return 0;
+}
+
+#endif
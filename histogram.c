@@ -0,0 +1,157 @@
+/* Latency histograms
+ *
+ * Log-linear buckets in the manner of HdrHistogram: exact below 128ns,
+ * and within 1/64 of the true value above that, up to a few days.
+ * Recording is a count-leading-zeros and an increment.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "histogram.h"
+
+enum {
+    SUB_BUCKETS = 1<<HISTOGRAM_SUB_BUCKET_BITS,
+    HALF_SUB_BUCKETS = SUB_BUCKETS/2
+};
+
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static unsigned bucket_of(uint64_t v)
+{
+    if (v < SUB_BUCKETS)
+        return v;
+    if (v >> HISTOGRAM_MAX_BITS)
+        v = ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1;
+    unsigned shift = 63 - __builtin_clzll(v) - (HISTOGRAM_SUB_BUCKET_BITS-1);
+    return SUB_BUCKETS + (shift-1) * HALF_SUB_BUCKETS + (v >> shift) - HALF_SUB_BUCKETS;
+}
+
+
+static uint64_t bucket_low(unsigned i)
+{
+    if (i < SUB_BUCKETS)
+        return i;
+    unsigned shift = (i - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+    uint64_t sub = (i - SUB_BUCKETS) % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+    return sub << shift;
+}
+
+
+static uint64_t bucket_high(unsigned i)
+{
+    return i+1 < HISTOGRAM_BUCKETS ? bucket_low(i+1) - 1 : UINT64_MAX;
+}
+
+
+/* The histogram is allocated on first use, since most functions in a
+ * NIF are never called. */
+bool histogram_record(struct histogram **hp, uint64_t v)
+{
+    struct histogram *h = *hp;
+    if (NULL == h) {
+        if (NULL == (h = *hp = calloc(1, sizeof(*h))))
+            return false;
+        h->min = UINT64_MAX;
+    }
+    ++h->count;
+    h->total += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    ++h->buckets[bucket_of(v)];
+    return true;
+}
+
+
+/* The highest value in the bucket holding the pth percentile, but
+ * never more than the largest value actually recorded. */
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+    if (0 == h->count)
+        return 0;
+    uint64_t target = p/100 * h->count + 0.5, seen = 0;
+    if (0 == target)
+        return h->min;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+    }
+    return h->max;
+}
+
+
+void json_print_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; ++s) {
+        if ('"' == *s || '\\' == *s)
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+
+void histogram_print_json(FILE *out, const struct histogram *h)
+{
+    fprintf(out, "{\"count\": %llu, \"min_ns\": %llu, \"mean_ns\": %.1f",
+            (unsigned long long)h->count, (unsigned long long)h->min,
+            (double)h->total / h->count);
+    static const struct { const char *key; double p; } percentiles[] = {
+        {"p50_ns", 50}, {"p90_ns", 90}, {"p99_ns", 99},
+        {"p999_ns", 99.9}, {"p9999_ns", 99.99}
+    };
+    for (unsigned i = 0; i < sizeof(percentiles)/sizeof(*percentiles); ++i)
+        fprintf(out, ", \"%s\": %llu", percentiles[i].key,
+                (unsigned long long)histogram_percentile(h, percentiles[i].p));
+    fprintf(out, ", \"max_ns\": %llu, \"buckets\": [", (unsigned long long)h->max);
+    const char *sep = "";
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (0 == h->buckets[i])
+            continue;
+        fprintf(out, "%s[%llu, %llu, %llu]", sep,
+                (unsigned long long)bucket_low(i), (unsigned long long)bucket_high(i),
+                (unsigned long long)h->buckets[i]);
+        sep = ", ";
+    }
+    fputs("]}", out);
+}
+
+
+void histogram_print_csv_header(FILE *out)
+{
+    fputs("function,histogram,low_ns,high_ns,count\n", out);
+}
+
+
+/* One row per non-empty bucket. */
+void histogram_print_csv(FILE *out, const char *name, const char *kind,
+                         const struct histogram *h)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (0 == h->buckets[i])
+            continue;
+        fputc('"', out);
+        for (const char *s = name; *s; ++s) {
+            if ('"' == *s)
+                fputc('"', out);
+            fputc(*s, out);
+        }
+        fprintf(out, "\",%s,%llu,%llu,%llu\n", kind,
+                (unsigned long long)bucket_low(i), (unsigned long long)bucket_high(i),
+                (unsigned long long)h->buckets[i]);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Values below 2^SUB_BUCKET_BITS are counted exactly; above that,
+ * each power of two is split into 2^(SUB_BUCKET_BITS-1) buckets, so
+ * every bucket is within 1/64 of the values it holds. */
+enum {
+    HISTOGRAM_SUB_BUCKET_BITS = 7,
+    HISTOGRAM_MAX_BITS = 48,
+    HISTOGRAM_BUCKETS = (1<<HISTOGRAM_SUB_BUCKET_BITS) +
+        (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * (1<<(HISTOGRAM_SUB_BUCKET_BITS-1))
+};
+
+struct histogram {
+    uint64_t count, total, min, max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+extern uint64_t monotonic_ns(void);
+extern bool histogram_record(struct histogram **, uint64_t);
+extern uint64_t histogram_percentile(const struct histogram *, double);
+extern void json_print_string(FILE *, const char *);
+extern void histogram_print_json(FILE *, const struct histogram *);
+extern void histogram_print_csv_header(FILE *);
+extern void histogram_print_csv(FILE *, const char *, const char *, const struct histogram *);
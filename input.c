@@ -0,0 +1,117 @@
+/* Feeding scripts to the lexer
+ *
+ * A regular file is mapped whole and lexed as one buffer, so the lexer
+ * runs straight through it without stopping at every line.  Anything
+ * else (a pipe, a terminal) is read in large blocks, but taking
+ * whatever read(2) returns rather than waiting for a block to fill, so
+ * an interactive session still sees each line as it's typed.  A token
+ * cut off at the end of a block is carried over to the start of the
+ * next.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+
+static size_t block_size = 1 << 20;
+
+
+/* Zero leaves the block size at its default.  Small blocks are for
+ * tests, to cut tokens at every boundary the lexer has to handle. */
+void input_set_block_size(size_t size)
+{
+    if (size)
+        block_size = size;
+}
+
+
+/* Maps the rest of in, from wherever it's at now; false if in isn't a
+ * non-empty regular file or can't be mapped. */
+bool input_map(FILE *in, struct input_map *m)
+{
+    int fd = fileno(in);
+    off_t at = ftello(in);
+    struct stat st;
+    if (-1 == fd || -1 == at || 0 != fstat(fd, &st) ||
+        !S_ISREG(st.st_mode) || st.st_size <= at)
+        return false;
+    off_t start = at & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    m->len = st.st_size - start;
+    m->base = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, start);
+    if (MAP_FAILED == m->base)
+        return false;
+    (void)madvise(m->base, m->len, MADV_SEQUENTIAL);
+    m->text = (char *)m->base + (at - start);
+    m->text_len = st.st_size - at;
+    return true;
+}
+
+
+void input_unmap(struct input_map *m)
+{
+    munmap(m->base, m->len);
+    *m = (struct input_map){0};
+}
+
+
+static bool lex_blocks(int fd, struct lexer *lexer,
+                       void (*each)(void *, struct token *), void *data)
+{
+    size_t avail = block_size;
+    char *buf = malloc(avail);
+    if (NULL == buf)
+        return false;
+    struct token token;
+    bool ok = true;
+    for (;;) {
+        /* A token as big as half the buffer gets a bigger one. */
+        if (lex_partial_token_len(lexer) > avail/2) {
+            char *bigger = malloc(2*avail);
+            if (NULL == bigger) {
+                ok = false;
+                break;
+            }
+            lex_keep_partial_token(lexer, bigger);
+            free(buf);
+            buf = bigger;
+            avail *= 2;
+        }
+        size_t kept = lex_keep_partial_token(lexer, buf);
+        ssize_t nread = read(fd, buf + kept, avail - kept);
+        if (-1 == nread && EINTR == errno)
+            continue;
+        if (-1 == nread) {
+            perror("reading input");
+            ok = false;
+            nread = 0;
+        }
+        lex_setup_next_line(lexer, buf + kept, nread, 0 == nread);
+        while (lex(lexer, &token))
+            each(data, &token);
+        if (0 == nread)
+            break;
+    }
+    free(buf);
+    return ok;
+}
+
+
+/* Lexes everything left in in, handing each token to each along with
+ * data. */
+bool lex_input(FILE *in, struct lexer *lexer,
+               void (*each)(void *, struct token *), void *data)
+{
+    struct input_map m;
+    if (!input_map(in, &m))
+        return lex_blocks(fileno(in), lexer, each, data);
+    struct token token;
+    lex_setup_next_line(lexer, m.text, m.text_len, true);
+    while (lex(lexer, &token))
+        each(data, &token);
+    input_unmap(&m);
+    return true;
+}
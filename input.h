@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lex.h"
+
+struct input_map {
+    void *base;
+    size_t len;
+    char *text;
+    size_t text_len;
+};
+
+extern bool input_map(FILE *, struct input_map *);
+extern void input_unmap(struct input_map *);
+extern void input_set_block_size(size_t);
+extern bool lex_input(FILE *, struct lexer *, void (*)(void *, struct token *), void *);
@@ -40,6 +40,8 @@ struct lexer {                  /* private */
 
 extern void lex_init(struct lexer *);
 extern void lex_setup_next_line(struct lexer *, char *, size_t, bool);
+extern size_t lex_keep_partial_token(struct lexer *, char *);
+extern size_t lex_partial_token_len(const struct lexer *);
 extern bool lex(struct lexer *, struct token *);
 extern void destroy_token(struct token *);
 extern bool pretty_print_token(void *, struct token *);
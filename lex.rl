@@ -118,10 +118,7 @@ main := |*
   # atom
   [a-z@][0-9a-zA-Z_@]* => {
     token->type = TOK_ATOM;
-    struct str *name = str_new(state->te - state->ts);
-    name->len = state->te - state->ts;
-    memcpy(name->data, state->ts, name->len);
-    token->atom_value = intern(name);
+    token->atom_value = intern_bytes(state->ts, state->te - state->ts);
     fbreak;
   };
   quoted_atom => {
@@ -130,10 +127,7 @@ main := |*
   };
   [A-Z_][0-9a-zA-Z_]* => {
     token->type = TOK_VARIABLE;
-    struct str *name = str_new(state->te - state->ts);
-    name->len = state->te - state->ts;
-    memcpy(name->data, state->ts, name->len);
-    token->atom_value = intern(name);
+    token->atom_value = intern_bytes(state->ts, state->te - state->ts);
     fbreak;
   };
 
@@ -180,12 +174,39 @@ void lex_setup_next_line(struct lexer *state, char *line, size_t len, bool is_eo
 }
 
 
+size_t lex_partial_token_len(const struct lexer *state)
+{
+    if (NULL == state->ts || erlang_term_error == state->cs)
+        return 0;
+    return state->pe - state->ts;
+}
+
+
+/* If the lexer ran out of input partway through a token, move what
+ * it's seen of that token to the start of buf, so it can carry on once
+ * the rest is read in after it.  Returns how many bytes were moved. */
+size_t lex_keep_partial_token(struct lexer *state, char *buf)
+{
+    size_t len = lex_partial_token_len(state);
+    if (0 == len)
+        return 0;
+    memmove(buf, state->ts, len);
+    state->te = buf + (state->te - state->ts);
+    state->ts = buf;
+    state->p = state->pe = buf + len;
+    return len;
+}
+
+
 bool lex(struct lexer *state, struct token *token)
 {
     token->type = TOK_NOTHING;
     token->location = state->location;
 
-    if (state->p >= state->pe)
+    /* Input that ends partway through a token, after the buffer it
+     * started in, arrives as an empty last buffer. */
+    bool at_eof_p = state->p == state->eof;
+    if (state->p >= state->pe && !(at_eof_p && state->ts))
         return false;
 
     %% write exec;
@@ -196,6 +217,11 @@ bool lex(struct lexer *state, struct token *token)
         return false;
     }
 
+    if (at_eof_p) {
+        state->ts = NULL;
+        return TOK_NOTHING != token->type;
+    }
+
     /* p == pe when we need more data; we could be in the middle of a
      * token, though. */
     return (state->p < state->pe || state->pe == state->eof);
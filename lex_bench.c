@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "lex.h"
+#include "str.h"
+
+
+static void report(const char *what, size_t bytes, unsigned long tokens,
+                   uint64_t ns)
+{
+    printf("%-24s %10lu tokens %8.1f ns/token %8.1f MB/s\n", what, tokens,
+           (double)ns / tokens, bytes / (ns / 1e3));
+}
+
+
+static unsigned long lex_buffer(char *text, size_t len, size_t block)
+{
+    struct lexer lexer;
+    lex_init(&lexer);
+    struct token token;
+    unsigned long n = 0;
+    char *buf = malloc(block);
+    if (NULL == buf)
+        abort();
+    for (size_t at = 0; at <= len;) {
+        size_t kept = lex_keep_partial_token(&lexer, buf);
+        if (kept > block/2)
+            abort();
+        size_t chunk = len - at < block - kept ? len - at : block - kept;
+        memcpy(buf + kept, text + at, chunk);
+        lex_setup_next_line(&lexer, buf + kept, chunk, 0 == chunk);
+        while (lex(&lexer, &token)) {
+            destroy_token(&token);
+            ++n;
+        }
+        if (0 == chunk)
+            break;
+        at += chunk;
+    }
+    free(buf);
+    return n;
+}
+
+
+/* lex MB megabytes of a made-up script, as one buffer (as a mapped
+ * file is) and in 64 KiB blocks (as a pipe is); prints throughput for
+ * each */
+int main(int argc, char **argv)
+{
+    unsigned long mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    struct str *script = str_new(mb << 20);
+    for (unsigned long i = 0; script->len < mb << 20; ++i) {
+        char line[256];
+        int len = snprintf(line, sizeof(line),
+                           "X%lu = {ok, <<\"bin\", %lu>>, [1, -2, 16#ff, 3.5e%lu], $a, 'a quoted atom', \"a\\tstring\"}.\n"
+                           "niffy:element(%lu, X%lu). %% a comment\n",
+                           i % 1000, i & 0xff, i % 10, i % 6 + 1, i % 1000);
+        if (!str_append_bytes(&script, line, len))
+            abort();
+    }
+
+    struct lexer lexer;
+    lex_init(&lexer);
+    lex_setup_next_line(&lexer, script->data, script->len, true);
+    struct token token;
+    unsigned long n = 0;
+    uint64_t start = monotonic_ns();
+    while (lex(&lexer, &token)) {
+        destroy_token(&token);
+        ++n;
+    }
+    report("whole buffer", script->len, n, monotonic_ns() - start);
+
+    start = monotonic_ns();
+    unsigned long m = lex_buffer(script->data, script->len, 1 << 16);
+    report("64 KiB blocks", script->len, m, monotonic_ns() - start);
+
+    str_free(&script);
+    return m != n;
+}
@@ -2,30 +2,28 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "input.h"
 #include "lex.h"
 
 
-/* read terms from stdin, print token information to stdout */
-int main(void)
+static void print(void *data, struct token *token)
 {
-    FILE *in = stdin;
-    char *line = NULL;
-    size_t line_len = 0;
+    (void)data;
+    pretty_print_token(stdout, token);
+    fputc('\n', stdout);
+    destroy_token(token);
+}
+
 
+/* read terms from stdin, print token information to stdout; an
+ * argument sets the size of the blocks a pipe is read in */
+int main(int argc, char **argv)
+{
     struct lexer lexer;
     lex_init(&lexer);
 
-    ssize_t nread = 0;
-    while (-1 != (nread = getline(&line, &line_len, in))) {
-        lex_setup_next_line(&lexer, line, nread, feof(in));
-        struct token token;
-
-        while (lex(&lexer, &token)) {
-            pretty_print_token(stdout, &token);
-            fputc('\n', stdout);
-            destroy_token(&token);
-        }
-    }
-    free(line);
+    if (argc > 1)
+        input_set_block_size(strtoul(argv[1], NULL, 10));
+    lex_input(stdin, &lexer, print, NULL);
 }
 
@@ -1,10 +1,20 @@
 #include <assert.h>
 #include <dlfcn.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include "ast.h"
+#include "dirty.h"
+#include "input.h"
 #include "niffy.h"
 #include "parse_protos.h"
+#include "program.h"
+#include "spsc.h"
+#include "str.h"
+#include "threads.h"
 
 #ifndef NIFFY_VERSION
 #define NIFFY_VERSION "0"
@@ -15,9 +25,21 @@ static void print_usage(FILE *out)
 {
     fprintf(out, "niffy [OPTION]... <NIF>\n");
     struct { const char *name, *description; } args[] = {
+        {"--bench=N", "time each call in stdin over N iterations"},
+        {"--counters", "count cycles, cache and branch misses per function"},
+        {"--dirty-cpu=N", "run dirty CPU jobs on N threads"},
+        {"--dirty-io=N", "run dirty IO jobs on N threads"},
         {"--help", "display this help and exit"},
+        {"--latency=FILE", "write per-function latency histograms to FILE"},
         {"--lazy", "resolve NIF symbols lazily"},
+        {"--locks", "profile contention on NIF mutexes and rwlocks"},
+        {"--no-parse-thread", "parse stdin on the thread that runs it"},
+        {"--parallel=N", "run independent statements in stdin on N threads"},
+        {"--parse-thread", "parse stdin on a thread of its own"},
         {"--quiet", "print less information"},
+        {"--repeat=N", "compile stdin once and run it N times"},
+        {"--threads=N", "run stdin on N threads at once and report throughput"},
+        {"--timeslice=USEC", "report timeslices used per call, of USEC each"},
         {"--verbose", "print more information"},
         {"--version", "output version and exit"},
         {NULL, NULL}
@@ -27,31 +49,279 @@ static void print_usage(FILE *out)
 }
 
 
+/* Given more than one CPU (or --parse-thread), statements are parsed
+ * on a thread of their own, and handed over to the main thread to run
+ * with their arguments copied into an env that goes with the slot, so
+ * the parser never waits for a NIF unless it's a whole queue ahead.
+ * (On one CPU, the two threads would only take turns.) */
+struct parsed_statement {
+    struct statement st;
+    ErlNifEnv *env;
+    bool end_p;
+};
+
+enum { PARSE_AHEAD = 256 };
+
+static struct spsc parsed;
+
+
+static void queue_statement(struct statement *st)
+{
+    struct parsed_statement *ps = spsc_claim(&parsed);
+    if (NULL == ps->env && NULL == (ps->env = enif_alloc_env()))
+        abort();
+    ps->st = *st;
+    if (AST_ST_V_OF_TERM == st->type || AST_ST_V_OF_MFA == st->type || AST_ST_MFA == st->type)
+        ps->st.call.args = enif_make_copy(ps->env, st->call.args);
+    ps->end_p = false;
+    spsc_publish(&parsed);
+    /* This thread's own NULL env, where the parser built the terms. */
+    enif_clear_env(NULL);
+}
+
+
+struct parse_state {
+    void *pParser;
+    struct lexer *lexer;
+    void (*handle)(struct statement *);
+};
+
+
+static void parse_token(void *data, struct token *token)
+{
+    struct parse_state *ps = data;
+    Parse(ps->pParser, token->type, *token, ps->handle);
+    /* Slight hack to allow nicer interactive sessions.  We
+       don't have nested expressions, so if we see a dot, we
+       encourage the parser to do its work eagerly. */
+    if (token->type == TOK_DOT)
+        Parse(ps->pParser, 0, (struct token){.type = 0, .location = ps->lexer->location}, ps->handle);
+}
+
+
+static void parse(FILE *in, void (*handle)(struct statement *))
+{
+    struct lexer lexer;
+    lex_init(&lexer);
+    struct parse_state ps = {.lexer = &lexer, .handle = handle};
+
+    ps.pParser = ParseAlloc(malloc);
+    lex_input(in, &lexer, parse_token, &ps);
+
+    Parse(ps.pParser, 0, (struct token){.type = 0, .location = lexer.location}, handle);
+    ParseFree(ps.pParser, free);
+}
+
+
+static void *parse_input(void *in)
+{
+    parse(in, queue_statement);
+    struct parsed_statement *ps = spsc_claim(&parsed);
+    ps->end_p = true;
+    spsc_publish(&parsed);
+    enif_free_env(NULL);
+    return NULL;
+}
+
+
+/* parse_thread_p is 1 or 0 to force either way, or -1 to decide by
+ * the number of CPUs. */
+static int run(FILE *in, int parse_thread_p)
+{
+    if (-1 == parse_thread_p)
+        parse_thread_p = sysconf(_SC_NPROCESSORS_ONLN) >= 2;
+    if (!parse_thread_p) {
+        parse(in, niffy_handle_statement);
+        niffy_destroy_environments();
+        return 0;
+    }
+
+    pthread_t parser;
+    if (!spsc_init(&parsed, PARSE_AHEAD, sizeof(struct parsed_statement)) ||
+        0 != pthread_create(&parser, NULL, parse_input, in)) {
+        fprintf(stderr, "couldn't start parser thread\n");
+        return 1;
+    }
+
+    for (;;) {
+        struct parsed_statement *ps = spsc_peek(&parsed);
+        if (ps->end_p) {
+            spsc_release(&parsed);
+            break;
+        }
+        niffy_handle_statement(&ps->st);
+        enif_clear_env(ps->env);
+        spsc_release(&parsed);
+    }
+
+    pthread_join(parser, NULL);
+    for (size_t i = 0; i < PARSE_AHEAD; ++i) {
+        struct parsed_statement *ps = spsc_slot(&parsed, i);
+        if (ps->env)
+            enif_free_env(ps->env);
+    }
+    spsc_destroy(&parsed);
+
+    niffy_destroy_environments();
+    return 0;
+}
+
+
+static int run_compiled(FILE *in, long n, long bench_iterations, long threads,
+                        long workers)
+{
+    struct input_map m;
+    struct str *script = NULL;
+    if (!input_map(in, &m)) {
+        char buf[1 << 16];
+        size_t len;
+        script = str_new(sizeof(buf));
+        while ((len = fread(buf, 1, sizeof(buf), in)))
+            if (!str_append_bytes(&script, buf, len))
+                abort();
+        if (ferror(in)) {
+            perror("reading script");
+            return 1;
+        }
+        m = (struct input_map){.text = script->data, .text_len = script->len};
+    }
+
+    struct program *program = program_compile(m.text, m.text_len);
+    if (script)
+        str_free(&script);
+    else
+        input_unmap(&m);
+    if (NULL == program) {
+        fprintf(stderr, "couldn't compile script\n");
+        return 1;
+    }
+    program_bench(program, bench_iterations);
+    if (threads) {
+        if (!program_stress(program, threads, n)) {
+            fprintf(stderr, "couldn't set up %ld threads\n", threads);
+            return 1;
+        }
+    } else if (workers) {
+        while (n-- > 0) {
+            if (!program_replay(program, workers)) {
+                fprintf(stderr, "couldn't set up parallel replay\n");
+                return 1;
+            }
+        }
+    } else {
+        while (n-- > 0)
+            program_run(program);
+    }
+    program_free(program);
+
+    niffy_destroy_environments();
+    return 0;
+}
+
+
 int main(int argc, char **argv)
 {
     int option_index = 0, c;
     const struct option long_opts[] = {
+        {"bench", required_argument, 0, 'b'},
+        {"counters", no_argument, 0, 'c'},
+        {"dirty-cpu", required_argument, 0, 'C'},
+        {"dirty-io", required_argument, 0, 'I'},
         {"help", no_argument, 0, 'h'},
+        {"latency", required_argument, 0, 'L'},
         {"lazy", no_argument, 0, 'l'},
+        {"locks", no_argument, 0, 'k'},
+        {"no-parse-thread", no_argument, 0, 'N'},
+        {"parallel", required_argument, 0, 'P'},
+        {"parse-thread", no_argument, 0, 'p'},
         {"quiet", no_argument, 0, 'q'},
+        {"repeat", required_argument, 0, 'r'},
+        {"threads", required_argument, 0, 'T'},
+        {"timeslice", required_argument, 0, 't'},
         {"verbose", no_argument, 0, 'v'},
         {"version", no_argument, 0, 'V'},
         {0,0,0,0}
     };
     int rtld_mode = RTLD_NOW;
     int verbosity = 1;
+    long repeat = 0, bench_iterations = 0;
+    bool perf_counters_p = false;
+    const char *latency_path = NULL;
+    long timeslice_us = 0, dirty_cpu_threads = 0, dirty_io_threads = 0, threads = 0;
+    long workers = 0;
+    int parse_thread_p = -1;
 
-    while (-1 != (c = getopt_long(argc, argv, "hlqvV", long_opts, &option_index))) {
+    while (-1 != (c = getopt_long(argc, argv, "b:cC:hI:kL:lNP:pqr:T:t:vV", long_opts, &option_index))) {
         switch (c) {
+        case 'b':
+            bench_iterations = strtol(optarg, NULL, 10);
+            if (bench_iterations < 1) {
+                fprintf(stderr, "--bench needs a positive count\n");
+                return 1;
+            }
+            break;
+        case 'c':
+            perf_counters_p = true;
+            break;
+        case 'C':
+        case 'I':
+        {
+            long n = strtol(optarg, NULL, 10);
+            if (n < 1) {
+                fprintf(stderr, "%s needs a positive number of threads\n",
+                        'C' == c ? "--dirty-cpu" : "--dirty-io");
+                return 1;
+            }
+            *('C' == c ? &dirty_cpu_threads : &dirty_io_threads) = n;
+            break;
+        }
         case 'h':
             print_usage(stdout);
             return 0;
+        case 'k':
+            lock_profile_enable();
+            break;
+        case 'L':
+            latency_path = optarg;
+            break;
         case 'l':
             rtld_mode = RTLD_LAZY;
             break;
+        case 'N':
+        case 'p':
+            parse_thread_p = 'p' == c;
+            break;
+        case 'P':
+            workers = strtol(optarg, NULL, 10);
+            if (workers < 1) {
+                fprintf(stderr, "--parallel needs a positive number of threads\n");
+                return 1;
+            }
+            break;
         case 'q':
             verbosity = -999;
             break;
+        case 'r':
+            repeat = strtol(optarg, NULL, 10);
+            if (repeat < 1) {
+                fprintf(stderr, "--repeat needs a positive count\n");
+                return 1;
+            }
+            break;
+        case 'T':
+            threads = strtol(optarg, NULL, 10);
+            if (threads < 1) {
+                fprintf(stderr, "--threads needs a positive count\n");
+                return 1;
+            }
+            break;
+        case 't':
+            timeslice_us = strtol(optarg, NULL, 10);
+            if (timeslice_us < 1) {
+                fprintf(stderr, "--timeslice needs a positive number of microseconds\n");
+                return 1;
+            }
+            break;
         case 'v':
             ++verbosity;
             break;
@@ -67,6 +337,17 @@ int main(int argc, char **argv)
         fprintf(stderr, "no NIF specified\n");
         return 1;
     }
+    /* These keep their figures per function, unsynchronized. */
+    if ((threads || workers) &&
+        (bench_iterations || perf_counters_p || latency_path || timeslice_us)) {
+        fprintf(stderr, "%s can't be used with --bench, --counters, --latency or --timeslice\n",
+                threads ? "--threads" : "--parallel");
+        return 1;
+    }
+    if (threads && workers) {
+        fprintf(stderr, "--threads and --parallel can't be used together\n");
+        return 1;
+    }
 
     int n_sos = argc-optind;
     assert(n_sos > 0);
@@ -74,38 +355,21 @@ int main(int argc, char **argv)
     niffy_construct_erlang_env();
     niffy_construct_assert_env();
 
+    if (perf_counters_p && !niffy_enable_perf_counters())
+        return 1;
+    if (latency_path && !niffy_enable_latency_histograms(latency_path))
+        return 1;
+    if (timeslice_us)
+        niffy_enable_timeslice_report(timeslice_us * 1000);
+    dirty_start(dirty_cpu_threads, dirty_io_threads);
+
     for (int so_idx = 0; so_idx < n_sos && optind < argc; ++so_idx, ++optind) {
         if (!niffy_load_so(argv[optind], rtld_mode, verbosity))
             return 1;
     }
 
-    FILE *in = stdin;
-    char *line = NULL;
-    size_t line_len = 0;
-    struct lexer lexer;
-    lex_init(&lexer);
-    void *pParser;
+    if (repeat || bench_iterations || threads || workers)
+        return run_compiled(stdin, repeat ? repeat : 1, bench_iterations, threads, workers);
 
-    pParser = ParseAlloc(malloc);
-    ssize_t nread = 0;
-    while (-1 != (nread = getline(&line, &line_len, in))) {
-        lex_setup_next_line(&lexer, line, nread, feof(in));
-        struct token token;
-
-        while (lex(&lexer, &token)) {
-            Parse(pParser, token.type, token, niffy_handle_statement);
-            /* Slight hack to allow nicer interactive sessions.  We
-               don't have nested expressions, so if we see a dot, we
-               encourage the parser to do its work eagerly. */
-            if (token.type == TOK_DOT)
-                Parse(pParser, 0, (struct token){.type = 0, .location = lexer.location}, niffy_handle_statement);
-        }
-    }
-
-    Parse(pParser, 0, (struct token){.type = 0, .location = lexer.location}, niffy_handle_statement);
-    free(line);
-    ParseFree(pParser, free);
-
-    niffy_destroy_environments();
-    return 0;
+    return run(stdin, parse_thread_p);
 }
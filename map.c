@@ -1,127 +1,245 @@
-/* Trivial two-choice hash table for int32 -> void*
+/* Open-addressing hash table for int32 -> void*, after SwissTable
+ *
+ * Each slot has a control byte: empty, deleted, or the low 7 bits of
+ * the key's hash.  Slots are probed a group of 16 at a time, comparing
+ * all 16 control bytes against the hash at once (with SSE2 where we
+ * have it), so a lookup usually touches one line of control bytes and
+ * the one entry that matches.  Probing stops at the first group with
+ * an empty slot.
+ *
+ * The table grows once it's 7/8ths full, counting deleted slots.
+ * Deleting leaves a tombstone only when the slot's group is full, since
+ * otherwise no probe can have passed through it.
  */
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "map.h"
 
 typedef uint32_t hash;
 
+enum {
+    GROUP_WIDTH = 16,
+    MIN_CAPACITY = GROUP_WIDTH
+};
+
+enum {
+    CTRL_EMPTY = 0x80,
+    CTRL_DELETED = 0xfe
+};
+
+typedef uint16_t bitmask;
+
 
-/* per Bob Jenkins */
-static hash hash_1(atom a, uint32_t m)
+/* Knuth's multiplicative hash, finished with a murmur3-style mix so
+ * the high bits (which choose the group) depend on the low bits of
+ * the atom as well. */
+static hash hash_of(atom a)
 {
-    a = (a+0x7ed55d16) + (a<<12);
-    a = (a^0xc761c23c) ^ (a>>19);
-    a = (a+0x165667b1) + (a<<5);
-    a = (a+0xd3a2646c) ^ (a<<9);
-    a = (a+0xfd7046c5) + (a<<3);
-    a = (a^0xb55a4f09) ^ (a>>16);
-    assert(m > 0);
-    return a % m;
+    hash h = a * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
 }
 
-/* per Knuth */
-static hash hash_2(atom a, uint32_t m)
+static uint8_t h2(hash h) { return h & 0x7f; }
+static size_t h1(hash h) { return h >> 7; }
+
+
+#ifdef __SSE2__
+static bitmask match_byte(const uint8_t *group, uint8_t b)
 {
-    assert(m > 0);
-    return (a * 2654435761) % m;
+    __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b)));
 }
 
+/* Empty and deleted both have the top bit set, and full slots don't. */
+static bitmask match_empty_or_deleted(const uint8_t *group)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+static bitmask match_byte(const uint8_t *group, uint8_t b)
+{
+    bitmask m = 0;
+    for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+        m |= (bitmask)(group[i] == b) << i;
+    return m;
+}
 
-static bool insert(struct atom_ptr_map *m, struct atom_ptr_pair p)
+static bitmask match_empty_or_deleted(const uint8_t *group)
 {
-    hash h1 = hash_1(p.k, m->avail), h2 = hash_2(p.k, m->avail), h;
-    if (m->entries[h1].k == p.k)
-        h = h1;
-    else if (m->entries[h2].k == p.k)
-        h = h2;
-    else if (m->entries[h1].k == 0)
-        h = h1;
-    else if (m->entries[h2].k == 0)
-        h = h2;
-    else
-        return false;
-    m->entries[h] = p;
-    return true;
+    bitmask m = 0;
+    for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+        m |= (bitmask)(group[i] >> 7) << i;
+    return m;
+}
+#endif
+
+static bitmask match_empty(const uint8_t *group)
+{
+    return match_byte(group, CTRL_EMPTY);
+}
+
+
+/* Groups are visited in triangular order, which reaches every group
+ * when there's a power of two of them. */
+struct probe {
+    size_t group, stride, mask;
+};
+
+static struct probe probe_start(const struct atom_ptr_map *m, hash h)
+{
+    size_t mask = m->avail / GROUP_WIDTH - 1;
+    return (struct probe){.group = h1(h) & mask, .stride = 0, .mask = mask};
+}
+
+static void probe_next(struct probe *p)
+{
+    p->group = (p->group + ++p->stride) & p->mask;
+}
+
+
+static size_t capacity_limit(size_t capacity)
+{
+    return capacity - capacity/8;
+}
+
+
+static ptrdiff_t find(const struct atom_ptr_map *m, atom k, hash h)
+{
+    if (0 == m->avail)
+        return -1;
+    for (struct probe p = probe_start(m, h);; probe_next(&p)) {
+        const uint8_t *group = m->ctrl + p.group * GROUP_WIDTH;
+        for (bitmask b = match_byte(group, h2(h)); b; b &= b-1) {
+            size_t i = p.group * GROUP_WIDTH + __builtin_ctz(b);
+            if (m->entries[i].k == k)
+                return i;
+        }
+        if (match_empty(group))
+            return -1;
+    }
+}
+
+
+static size_t find_free_slot(const struct atom_ptr_map *m, hash h)
+{
+    for (struct probe p = probe_start(m, h);; probe_next(&p)) {
+        bitmask b = match_empty_or_deleted(m->ctrl + p.group * GROUP_WIDTH);
+        if (b)
+            return p.group * GROUP_WIDTH + __builtin_ctz(b);
+    }
 }
 
 
-static bool grow(struct atom_ptr_map *m)
+static bool resize(struct atom_ptr_map *m, size_t capacity)
 {
-    size_t original_size = m->avail;
-    size_t next = 16;
-    enum { BIG_MAP_LEN = 2048 };
-    if (m->avail >= BIG_MAP_LEN)
-        next = m->avail + (m->avail >> 1);
-    else if (m->avail >= next)
-        next = m->avail * 2;
-    struct atom_ptr_pair *old = m->entries;
-    m->entries = calloc(next, sizeof(*m->entries));
-    if (NULL == m->entries) {
-        m->entries = old;
+    uint8_t *ctrl = malloc(capacity);
+    struct atom_ptr_pair *entries = malloc(capacity * sizeof(*entries));
+    if (NULL == ctrl || NULL == entries) {
+        free(ctrl);
+        free(entries);
         return false;
     }
-    m->avail = next;
-    for (size_t i = 0; i < original_size; ++i) {
-        struct atom_ptr_pair p = old[i];
-        if (p.k) {
-            if (!insert(m, p)) {
-                free(m->entries);
-                m->entries = old;
-                m->avail = original_size;
-                return false;
-            }
-            /*  maybe grow again */
-        }
+    memset(ctrl, CTRL_EMPTY, capacity);
+
+    struct atom_ptr_map old = *m;
+    m->ctrl = ctrl;
+    m->entries = entries;
+    m->avail = capacity;
+    m->growth_left = capacity_limit(capacity) - m->len;
+    for (size_t i = 0; i < old.avail; ++i) {
+        if (old.ctrl[i] & 0x80)
+            continue;
+        hash h = hash_of(old.entries[i].k);
+        size_t j = find_free_slot(m, h);
+        m->ctrl[j] = h2(h);
+        m->entries[j] = old.entries[i];
     }
-    free(old);
+    free(old.ctrl);
+    free(old.entries);
     return true;
 }
 
 
+/* Out of room: if much of that is tombstones, clearing them out is
+ * enough; otherwise double. */
+static bool make_room(struct atom_ptr_map *m)
+{
+    if (0 == m->avail)
+        return resize(m, MIN_CAPACITY);
+    if (m->len < capacity_limit(m->avail) / 2)
+        return resize(m, m->avail);
+    return resize(m, 2 * m->avail);
+}
+
+
 bool map_insert(struct atom_ptr_map *m, atom k, void *v)
 {
-    if ((m->avail == 0 || m->len == m->avail) &&
-        !grow(m))
-        return false;
-    if (insert(m, (struct atom_ptr_pair){.k = k, .v = v})) {
-        ++m->len;
+    assert(k != 0);
+    hash h = hash_of(k);
+    ptrdiff_t i = find(m, k, h);
+    if (i >= 0) {
+        m->entries[i].v = v;
         return true;
     }
-    if (!grow(m))
+    if (0 == m->growth_left && !make_room(m))
         return false;
-    return map_insert(m, k, v);
+    size_t j = find_free_slot(m, h);
+    /* Reusing a tombstone doesn't use up any more of the table. */
+    if (CTRL_EMPTY == m->ctrl[j])
+        --m->growth_left;
+    m->ctrl[j] = h2(h);
+    m->entries[j] = (struct atom_ptr_pair){.k = k, .v = v};
+    ++m->len;
+    return true;
 }
 
 
 void *map_lookup(struct atom_ptr_map *m, atom k)
 {
-    if (m->avail == 0)
-        return NULL;
+    ptrdiff_t i = find(m, k, hash_of(k));
+    return i < 0 ? NULL : m->entries[i].v;
+}
+
 
-    hash h = hash_1(k, m->avail);
-    if (m->entries[h].k == k)
-        return m->entries[h].v;
-    h = hash_2(k, m->avail);
-    if (m->entries[h].k == k)
-        return m->entries[h].v;
-    return NULL;
+bool map_remove(struct atom_ptr_map *m, atom k)
+{
+    ptrdiff_t i = find(m, k, hash_of(k));
+    if (i < 0)
+        return false;
+    const uint8_t *group = m->ctrl + (i & ~(ptrdiff_t)(GROUP_WIDTH-1));
+    if (match_empty(group)) {
+        m->ctrl[i] = CTRL_EMPTY;
+        ++m->growth_left;
+    } else
+        m->ctrl[i] = CTRL_DELETED;
+    --m->len;
+    return true;
 }
 
 
 void map_destroy(struct atom_ptr_map *m)
 {
+    free(m->ctrl);
     free(m->entries);
+    m->ctrl = NULL;
     m->entries = NULL;
-    m->avail = 0;
+    m->avail = m->len = m->growth_left = 0;
 }
 
 
 void map_iter(struct atom_ptr_map *m, void (*f)(struct atom_ptr_pair))
 {
     for (size_t i = 0; i < m->avail; ++i)
-        if (m->entries[i].k)
+        if (!(m->ctrl[i] & 0x80))
             f(m->entries[i]);
 }
@@ -2,18 +2,22 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "atom.h"
 
+/* Zero-initialized is empty.  Atom 0 can't be a key. */
 struct atom_ptr_map {
+    uint8_t *ctrl;
     struct atom_ptr_pair {
         atom k;
         void *v;
     } *entries;
-    size_t len, avail;
+    size_t len, avail, growth_left;
 };
 
 extern bool map_insert(struct atom_ptr_map *, atom, void *);
 extern void *map_lookup(struct atom_ptr_map *, atom);
+extern bool map_remove(struct atom_ptr_map *, atom);
 extern void map_destroy(struct atom_ptr_map *);
 extern void map_iter(struct atom_ptr_map *, void (*)(struct atom_ptr_pair));
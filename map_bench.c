@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "histogram.h"
+#include "map.h"
+
+
+static void report(const char *what, unsigned long n, uint64_t ns)
+{
+    printf("%-24s %10lu %8.1f ns/op %12.0f ops/sec\n", what, n,
+           (double)ns / n, n / (ns / 1e9));
+}
+
+
+/* insert N atoms, look them up (and N that aren't there), delete half
+ * and insert them again; prints time per operation for each */
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    atom *keys = malloc(2 * n * sizeof(*keys));
+    if (NULL == keys)
+        abort();
+    /* Atoms are handed out in order, but variables and functions are
+     * a scattering of them.  Distinct for up to 2^25 keys. */
+    for (unsigned long i = 0; i < 2*n; ++i)
+        keys[i] = ((i+1) * 2654435761u) & ((1u<<26) - 1);
+    struct atom_ptr_map m = {0};
+
+    uint64_t start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+        if (!map_insert(&m, keys[i], &keys[i]))
+            abort();
+    report("insert", n, monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+        if (NULL == map_lookup(&m, keys[i]))
+            abort();
+    report("lookup (present)", n, monotonic_ns() - start);
+
+    unsigned long found = 0;
+    start = monotonic_ns();
+    for (unsigned long i = n; i < 2*n; ++i)
+        found += NULL != map_lookup(&m, keys[i]);
+    report("lookup (absent)", n, monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; i += 2)
+        if (!map_remove(&m, keys[i]))
+            abort();
+    report("remove", n/2, monotonic_ns() - start);
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; i += 2)
+        if (!map_insert(&m, keys[i], &keys[i]))
+            abort();
+    report("reinsert", n/2, monotonic_ns() - start);
+
+    if (m.len != n)
+        abort();
+    map_destroy(&m);
+    free(keys);
+    return found > n;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+enum { N_KEYS = 4096, PHASE_LENGTH = 50000, N_PHASES = 20 };
+
+/* What the map should hold: NULL for keys that aren't in it. */
+static void *expected[N_KEYS];
+static size_t n_seen;
+static bool ok = true;
+
+
+static void fail(const char *what, atom k)
+{
+    printf("%s: key %u\n", what, k);
+    ok = false;
+}
+
+
+static void check_pair(struct atom_ptr_pair p)
+{
+    ++n_seen;
+    if (p.k >= N_KEYS || expected[p.k] != p.v)
+        fail("iterated over a wrong pair", p.k);
+}
+
+
+/* random inserts, overwrites, lookups and removals over a small key
+ * space, checked against a plain array; phases alternate between
+ * mostly inserting, so the table grows, and mostly removing, so it
+ * fills with tombstones.  Prints each disagreement; exits non-zero if
+ * there were any. */
+int main(int argc, char **argv)
+{
+    srandom(argc > 1 ? strtoul(argv[1], NULL, 10) : 1);
+    struct atom_ptr_map m = {0};
+    size_t len = 0;
+
+    for (int phase = 0; phase < N_PHASES && ok; ++phase) {
+        long insert_percent = phase % 2 ? 30 : 70;
+        for (int i = 0; i < PHASE_LENGTH && ok; ++i) {
+            atom k = 1 + random() % (N_KEYS-1);
+            long r = random() % 100;
+            if (r < insert_percent) {
+                void *v = &expected[random() % N_KEYS];
+                if (!map_insert(&m, k, v))
+                    fail("insert failed", k);
+                len += NULL == expected[k];
+                expected[k] = v;
+            } else if (r < 90) {
+                bool present_p = NULL != expected[k];
+                if (map_remove(&m, k) != present_p)
+                    fail("remove disagreed", k);
+                len -= present_p;
+                expected[k] = NULL;
+            } else if (map_lookup(&m, k) != expected[k])
+                fail("lookup disagreed", k);
+            if (m.len != len)
+                fail("length disagreed", k);
+        }
+
+        for (atom k = 1; k < N_KEYS; ++k)
+            if (map_lookup(&m, k) != expected[k])
+                fail("lookup disagreed after phase", k);
+        n_seen = 0;
+        map_iter(&m, check_pair);
+        if (n_seen != len)
+            fail("iterated over the wrong number of pairs", 0);
+    }
+
+    map_destroy(&m);
+    if (ok)
+        puts("ok");
+    return !ok;
+}
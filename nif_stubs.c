@@ -2,9 +2,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "atom.h"
+#include "histogram.h"
 #include "macrology.h"
 #include "nif_stubs.h"
 
@@ -19,12 +21,17 @@
 #define TAG_PRIMARY_IMMED 0x3
 #define TAG_IMMED1_SIZE 4
 #define TAG_IMMED1 ((1<<TAG_IMMED1_SIZE)-1)
+#define TAG_IMMED1_PID 0x3
 #define TAG_IMMED1_SMALL 0xf
 #define TAG_IMMED2_SIZE 6
 #define TAG_IMMED2 ((1<<TAG_IMMED2_SIZE)-1)
 #define TAG_IMMED2_ATOM 0xB
+/* Not in ERTS: stands for a variable in parsed terms; see
+ * substitute_variables. */
+#define TAG_IMMED2_VARIABLE 0x2B
 #define TAG_IMMED2_NIL 0x3B
 #define TAG_HEADER_SIZE 6
+#define TAG_HEADER_REFC_BIN 0x8
 #define TAG_HEADER_FLONUM 0x18
 #define TAG_HEADER_HEAP_BIN 0x24
 #define TAG_HEADER_EXTERNAL_REF 0x38
@@ -52,21 +59,43 @@ struct flonum {
     double flonum;
 };
 
+/* Binaries bigger than this live off-heap and are reference counted
+ * (atomically, since NIF threads share them), as in ERTS. */
+#define ONHEAP_BIN_LIMIT 64
+
+struct refc_binary {
+    size_t refc;
+    unsigned char data[];
+};
+
+/* The on-heap handle for an off-heap binary.  It may refer to any
+ * slice of the data, which is how sub-binaries avoid copying. */
+struct proc_bin {
+    term header;
+    struct refc_binary *val;
+    unsigned char *bytes;
+    struct proc_bin *next;
+};
+
 #define CAR(p) ((p)[0])
 #define CDR(p) ((p)[1])
 
 
-static struct enif_environment_t global;
+/* The NULL env.  Each thread has its own, so niffy's parser can build
+ * terms while the previous statement runs. */
+static __thread struct enif_environment_t global;
 
-static bool track_freeable_pointer(struct enif_environment_t *env, void *p)
+/* Terms live in the environment's arena; the only thing that needs
+ * attention when it goes away is the resources its terms refer to. */
+static bool track_resource(struct enif_environment_t *env, void *obj)
 {
-    struct alloc *cell = malloc(sizeof(*cell));
+    if (!env) env = &global;
+    struct alloc *cell = arena_alloc(&env->heap, sizeof(*cell));
     if (cell == NULL)
         return false;
 
-    if (!env) env = &global;
     *cell = (struct alloc){
-        .p = p,
+        .p = obj,
         .next = env->allocations
     };
     env->allocations = cell;
@@ -77,14 +106,8 @@ static bool track_freeable_pointer(struct enif_environment_t *env, void *p)
 __attribute__((alloc_size(2), malloc))
 static void *alloc(ErlNifEnv *env, size_t size)
 {
-    void *p = malloc(size);
-    if (p == NULL)
-        return NULL;
-    if (!track_freeable_pointer(env, p)) {
-        free(p);
-        return NULL;
-    }
-    return p;
+    if (!env) env = &global;
+    return arena_alloc(&env->heap, size);
 }
 
 
@@ -97,11 +120,15 @@ term_type type_of_term(const term t)
     case TAG_PRIMARY_IMMED:
         if (TAG_IMMED1_SMALL == (t & TAG_IMMED1))
             return TERM_SMALL;
+        if (TAG_IMMED1_PID == (t & TAG_IMMED1))
+            return TERM_PID;
         switch (t & TAG_IMMED2) {
         case TAG_IMMED2_ATOM:
             return TERM_ATOM;
         case TAG_IMMED2_NIL:
             return TERM_NIL;
+        case TAG_IMMED2_VARIABLE:
+            return TERM_VARIABLE;
         default:
             return TERM_IMMEDIATE;
         }
@@ -120,6 +147,7 @@ term_type type_of_term(const term t)
         case TAG_HEADER_FLONUM:
             return TERM_FLOAT;
         case TAG_HEADER_HEAP_BIN:
+        case TAG_HEADER_REFC_BIN:
             return TERM_BIN;
         case TAG_HEADER_EXTERNAL_REF:
             return TERM_EXTREF;
@@ -141,6 +169,23 @@ term_type type_of_boxed_term(const term t)
 }
 
 
+static bool binary_bytes(const term *p, uint8_t **data, size_t *size)
+{
+    switch (p[0] & TAG_HEADER) {
+    case TAG_HEADER_HEAP_BIN:
+        *data = (uint8_t *)(p+1);
+        break;
+    case TAG_HEADER_REFC_BIN:
+        *data = ((struct proc_bin *)p)->bytes;
+        break;
+    default:
+        return false;
+    }
+    *size = p[0] >> TAG_HEADER_SIZE;
+    return true;
+}
+
+
 static void pretty_print_tuple(FILE *out, const term *p)
 {
     unsigned count = (*p) >> TAG_HEADER_SIZE;
@@ -265,8 +310,10 @@ static void print_binary_as_string(FILE *out, uint8_t *s, size_t len)
 
 void pretty_print_binary(FILE *out, const term *p)
 {
-    unsigned size = p[0] >> TAG_HEADER_SIZE;
-    uint8_t *q = (uint8_t *)(p+1);
+    size_t size;
+    uint8_t *q;
+    if (!binary_bytes(p, &q, &size))
+        abort();
 
     fputs("<<", out);
     if (is_printable_binary(q, size))
@@ -274,7 +321,7 @@ void pretty_print_binary(FILE *out, const term *p)
     else {
         if (size > 0)
             fprintf(out, "%u", q[0]);
-        for (unsigned i = 1; i < size; ++i)
+        for (size_t i = 1; i < size; ++i)
             fprintf(out, ",%u", q[i]);
     }
     fputs(">>", out);
@@ -294,9 +341,21 @@ void pretty_print_term(FILE *out, const term *p)
     case TERM_NIL:
         fputs("[]", out);
         break;
+    case TERM_PID:
+        fprintf(out, "<0.%u.0>", pid_untagged(t));
+        break;
     case TERM_IMMEDIATE:
         fprintf(out, "<unknown immediate>");
         break;
+    case TERM_VARIABLE:
+    {
+        const struct str *name = symbol_name(variable_untagged(t));
+        if (name)
+            str_print(out, name);
+        else
+            fprintf(out, "<variable %u>", variable_untagged(t));
+        break;
+    }
     case TERM_BOXED:
         pretty_print_term(out, unbox(t));
         break;
@@ -373,12 +432,11 @@ static bool inner_iolist_element_to_binary(struct str **acc, term t)
     switch (type_of_term(t)) {
     case TERM_BOXED:
     {
-        term *p = unbox(t);
-        if (TERM_BIN != type_of_term(p[0]))
+        uint8_t *s;
+        size_t size;
+        if (!binary_bytes(unbox(t), &s, &size))
             return false;
-        unsigned size = p[0] >> TAG_HEADER_SIZE;
-        const char *s = (const char *)(p+1);
-        return str_append_bytes(acc, s, size);
+        return str_append_bytes(acc, (const char *)s, size);
     }
 
     case TERM_SMALL:
@@ -407,7 +465,7 @@ static bool inner_iolist_to_binary(struct str **acc, term t)
 }
 
 
-bool iolist_to_binary(term t, term *u)
+bool iolist_to_binary(ErlNifEnv *env, term t, term *u)
 {
     if (!u) return false;
 
@@ -416,7 +474,7 @@ bool iolist_to_binary(term t, term *u)
         str_free(&acc);
         return false;
     }
-    *u = enif_make_binary(NULL, &(ErlNifBinary){.size = acc->len, .data = (unsigned char *)acc->data});
+    *u = enif_make_binary(env, &(ErlNifBinary){.size = acc->len, .data = (unsigned char *)acc->data});
     str_free(&acc);
     return true;
 }
@@ -466,11 +524,13 @@ int enif_get_double(ErlNifEnv *UNUSED, term t, double *dp)
 
 static int cmp_bin(term *a, term *b)
 {
-    size_t alen = a[0]>>TAG_HEADER_SIZE,
-        blen = b[0]>>TAG_HEADER_SIZE;
+    uint8_t *adata, *bdata;
+    size_t alen, blen;
+    if (!binary_bytes(a, &adata, &alen) || !binary_bytes(b, &bdata, &blen))
+        return 0;
     if (alen != blen)
         return 0;
-    return 0 == memcmp(a+1, b+1, alen);
+    return 0 == memcmp(adata, bdata, alen);
 }
 
 
@@ -580,61 +640,225 @@ int enif_is_ref(ErlNifEnv *UNUSED, term t)
 }
 
 
+int enif_is_pid(ErlNifEnv *UNUSED, term t)
+{
+    return type_of_term(t) == TERM_PID;
+}
+
+
 /* Not sure what to do here. */
 int enif_is_exception(ErlNifEnv *UNUSED, term UNUSED) { return 0; }
 
 int enif_is_map(ErlNifEnv *UNUSED, term UNUSED) { return 0; }
 int enif_is_fun(ErlNifEnv *UNUSED, term UNUSED) { return 0; }
-int enif_is_pid(ErlNifEnv *UNUSED, term UNUSED) { return 0; }
 int enif_is_port(ErlNifEnv *UNUSED, term UNUSED) { return 0; }
 
-static term copy_tuple(ErlNifEnv *env, term *p)
+struct substitution {
+    term (*f)(void *, term);
+    void *data;
+    /* Copy all of the term, rather than only the parts that have
+     * variables in them. */
+    bool copy_p;
+};
+
+static term copy_term(ErlNifEnv *, term, const struct substitution *);
+
+static term copy_tuple(ErlNifEnv *env, term t, const struct substitution *sub)
 {
+    term *p = unbox(t), *q = NULL;
     unsigned arity = p[0]>>TAG_HEADER_SIZE;
-    return enif_make_tuple_from_array(env, p+1, arity);
+    if (sub->copy_p) {
+        q = alloc(env, (1+arity) * sizeof(*q));
+        q[0] = p[0];
+    }
+    for (unsigned i = 0; i < arity; ++i) {
+        term u = copy_term(env, p[1+i], sub);
+        if (u == p[1+i] && !q)
+            continue;
+        if (!q) {
+            q = alloc(env, (1+arity) * sizeof(*q));
+            memcpy(q, p, (1+arity) * sizeof(*q));
+        }
+        q[1+i] = u;
+    }
+    return q ? box(q) : t;
 }
 
 
-static term copy_list(ErlNifEnv *UNUSED, term *UNUSED)
+/* Copies the cells of t up to u, returning where the next cell should
+ * be linked in. */
+static term *copy_list_prefix(ErlNifEnv *env, term t, term u, term *head)
 {
-    fprintf(stderr, "copy_list not implemented\n");
-    abort();
-    return THE_NON_VALUE;
+    term *q = head;
+    for (; t != u; t = CDR(unbox(t))) {
+        term *cell = alloc(env, 2*sizeof(*cell));
+        CAR(cell) = CAR(unbox(t));
+        *q = box_list(cell);
+        q = &CDR(cell);
+    }
+    return q;
+}
+
+
+/* Iterative along the spine, so long lists don't blow the stack. */
+static term copy_list(ErlNifEnv *env, term t, const struct substitution *sub)
+{
+    term head, u = t;
+    term *q = NULL;             /* non-NULL once we've had to copy */
+    int max_len = MAX_LIST_LENGTH;
+    while (TAG_PRIMARY_LIST == (u & TAG_PRIMARY) && --max_len > 0) {
+        term *p = unbox(u), car = copy_term(env, CAR(p), sub);
+        if (!q && (sub->copy_p || car != CAR(p)))
+            q = copy_list_prefix(env, t, u, &head);
+        if (q) {
+            term *cell = alloc(env, 2*sizeof(*cell));
+            CAR(cell) = car;
+            *q = box_list(cell);
+            q = &CDR(cell);
+        }
+        u = CDR(p);
+    }
+    term tail = copy_term(env, u, sub);
+    if (!q && tail == u)
+        return t;
+    if (!q)
+        q = copy_list_prefix(env, t, u, &head);
+    *q = tail;
+    return head;
 }
 
 
+static term make_proc_bin(ErlNifEnv *, struct refc_binary *, unsigned char *, size_t);
+
 static term copy_bin(ErlNifEnv *env, term *p)
 {
+    if (TAG_HEADER_REFC_BIN == (p[0] & TAG_HEADER)) {
+        struct proc_bin *pb = (struct proc_bin *)p;
+        __atomic_add_fetch(&pb->val->refc, 1, __ATOMIC_RELAXED);
+        return make_proc_bin(env, pb->val, pb->bytes, p[0]>>TAG_HEADER_SIZE);
+    }
     size_t len = p[0]>>TAG_HEADER_SIZE;
     return enif_make_binary(env, &(ErlNifBinary){.size = len, .data = (uint8_t *)(p+1)});
 }
 
 
-term enif_make_copy(ErlNifEnv *env, term t)
+/* Boxed terms other than tuples, which can't contain variables. */
+static term copy_boxed(ErlNifEnv *env, term *p)
 {
-    switch (type_of_term(t)) {
-    case TERM_SMALL:
-    case TERM_IMMEDIATE:
-    case TERM_NIL:
-        return t;
-    case TERM_TUPLE:
-        return copy_tuple(env, unbox(t));
-    case TERM_CONS:
-        return copy_list(env, unbox(t));
-    case TERM_BIN:
-        return copy_bin(env, unbox(t));
+    switch (p[0] & TAG_HEADER) {
+    case TAG_HEADER_FLONUM:
+        return enif_make_double(env, ((struct flonum *)p)->flonum);
+    case TAG_HEADER_HEAP_BIN:
+    case TAG_HEADER_REFC_BIN:
+        return copy_bin(env, p);
+    case TAG_HEADER_EXTERNAL_REF:
+        return enif_make_resource(env, *(void **)(p+1));
     default:
         /* XXX unimplemented */
-        fprintf(stderr, "copying a %d is unimplemented\n", type_of_term(t));
+        fprintf(stderr, "copying a %lx is unimplemented\n", p[0] & TAG_HEADER);
         abort();
         return THE_NON_VALUE;
     }
 }
 
 
-term enif_make_atom(ErlNifEnv *env, const char *name)
+/* The one traversal behind copying and substituting: rebuilds t in env
+ * with each variable replaced by sub->f(sub->data, v), sharing
+ * whatever has no variables in it unless sub->copy_p. */
+static term copy_term(ErlNifEnv *env, term t, const struct substitution *sub)
 {
-    return enif_make_atom_len(env, name, strlen(name));
+    switch (type_of_term(t)) {
+    case TERM_BOXED:
+        if (0 == (*unbox(t) & TAG_HEADER))
+            return copy_tuple(env, t, sub);
+        return sub->copy_p ? copy_boxed(env, unbox(t)) : t;
+    case TERM_CONS:
+        return copy_list(env, t, sub);
+    case TERM_VARIABLE:
+        return sub->f ? sub->f(sub->data, t) : t;
+    default:
+        /* immediates, and THE_NON_VALUE from unbound variables */
+        return t;
+    }
+}
+
+
+term enif_make_copy(ErlNifEnv *env, term t)
+{
+    return copy_term(env, t, &(struct substitution){.copy_p = true});
+}
+
+
+/* Like enif_make_copy, but replaces each variable with f(data, v). */
+term copy_substituting_variables(ErlNifEnv *env, term t,
+                                 term (*f)(void *, term), void *data)
+{
+    return copy_term(env, t, &(struct substitution){.f = f, .data = data, .copy_p = true});
+}
+
+
+/* Replaces each variable in t with f(data, v), sharing whatever
+ * doesn't contain any variables. */
+term substitute_variables(ErlNifEnv *env, term t,
+                          term (*f)(void *, term), void *data)
+{
+    return copy_term(env, t, &(struct substitution){.f = f, .data = data});
+}
+
+
+bool contains_variables(term t)
+{
+    int max_len = MAX_LIST_LENGTH;
+    while (--max_len > 0) {
+        switch (type_of_term(t)) {
+        case TERM_VARIABLE:
+            return true;
+        case TERM_CONS:
+            if (contains_variables(CAR(unbox(t))))
+                return true;
+            t = CDR(unbox(t));
+            continue;
+        case TERM_BOXED:
+        {
+            term *p = unbox(t);
+            if (0 != (p[0] & TAG_HEADER))
+                return false;
+            for (unsigned i = 0; i < p[0]>>TAG_HEADER_SIZE; ++i)
+                if (contains_variables(p[1+i]))
+                    return true;
+            return false;
+        }
+        default:
+            return false;
+        }
+    }
+    abort();
+}
+
+
+term make_pid(unsigned id)
+{
+    return TAG_IMMED1_PID | ((term)id << TAG_IMMED1_SIZE);
+}
+
+
+unsigned pid_untagged(term t)
+{
+    assert(TAG_IMMED1_PID == (t & TAG_IMMED1));
+    return t >> TAG_IMMED1_SIZE;
+}
+
+
+term tagged_variable(unsigned v)
+{
+    return TAG_IMMED2_VARIABLE | ((term)v << TAG_IMMED2_SIZE);
+}
+
+
+unsigned variable_untagged(term t)
+{
+    assert(TAG_IMMED2_VARIABLE == (t & TAG_IMMED2));
+    return t >> TAG_IMMED2_SIZE;
 }
 
 
@@ -651,30 +875,96 @@ atom atom_untagged(term t)
 }
 
 
+/* NIFs make the same few atoms from the same string literals over and
+ * over, so each thread remembers which atom it last made from a given
+ * address.  The name is still compared, in case the address is a
+ * buffer that's since been reused, but it's compared against the
+ * atom's name directly instead of being hashed and looked up. */
+enum { ATOM_CACHE_BITS = 8 };
+
+static __thread struct atom_cache_entry {
+    const char *name;
+    const struct str *s;
+    atom sym;
+} atom_cache[1 << ATOM_CACHE_BITS];
+
+
+static struct atom_cache_entry *atom_cache_entry(const char *name)
+{
+    return &atom_cache[((uintptr_t)name * 0x9e3779b97f4a7c15ull) >> (64 - ATOM_CACHE_BITS)];
+}
+
+
+static bool atom_cache_hit_p(const struct atom_cache_entry *e, const char *name)
+{
+    if (e->name != name)
+        return false;
+    /* Stops at the end of a shorter name, since atoms made from C
+     * strings have no NULs. */
+    size_t i = 0;
+    for (; i < e->s->len; ++i)
+        if (name[i] != e->s->data[i])
+            return false;
+    return '\0' == name[i];
+}
+
+
+static void atom_cache_fill(struct atom_cache_entry *e, const char *name, atom sym)
+{
+    e->name = name;
+    e->s = symbol_name(sym);
+    e->sym = sym;
+}
+
+
 #define MAX_ATOM_CHARACTERS 255
 
+term enif_make_atom(ErlNifEnv *env, const char *name)
+{
+    struct atom_cache_entry *e = atom_cache_entry(name);
+    if (atom_cache_hit_p(e, name))
+        return tagged_atom(e->sym);
+    size_t len = strlen(name);
+    if (len > MAX_ATOM_CHARACTERS)
+        return enif_make_badarg(env);
+    atom_cache_fill(e, name, intern_bytes(name, len));
+    return tagged_atom(e->sym);
+}
+
+
 term enif_make_atom_len(ErlNifEnv *env, const char *name, size_t len)
 {
     if (len > MAX_ATOM_CHARACTERS)
         return enif_make_badarg(env);
-    struct str *s = str_new(len);
-    s->len = len;
-    memcpy(s->data, name, len);
-    return tagged_atom(intern(s));
+    return tagged_atom(intern_bytes(name, len));
 }
 
 
-int enif_make_existing_atom(ErlNifEnv *env, const char *name, term *atom, ErlNifCharEncoding encoding)
+int enif_make_existing_atom(ErlNifEnv *UNUSED, const char *name, term *result,
+                            ErlNifCharEncoding encoding)
 {
-    return enif_make_existing_atom_len(env, name, strlen(name), atom, encoding);
+    assert(ERL_NIF_LATIN1 == encoding);
+    struct atom_cache_entry *e = atom_cache_entry(name);
+    if (!atom_cache_hit_p(e, name)) {
+        size_t len = strlen(name);
+        atom sym = len > MAX_ATOM_CHARACTERS ? 0 : lookup_atom(name, len);
+        if (0 == sym)
+            return 0;
+        atom_cache_fill(e, name, sym);
+    }
+    *result = tagged_atom(e->sym);
+    return 1;
 }
 
 
-int enif_make_existing_atom_len(ErlNifEnv *env, const char *name, size_t len, term *atom, ErlNifCharEncoding encoding)
+int enif_make_existing_atom_len(ErlNifEnv *UNUSED, const char *name, size_t len,
+                                term *result, ErlNifCharEncoding encoding)
 {
     assert(ERL_NIF_LATIN1 == encoding);
-    /* XXX need to avoid interning here */
-    *atom = enif_make_atom_len(env, name, len);
+    atom sym = len > MAX_ATOM_CHARACTERS ? 0 : lookup_atom(name, len);
+    if (0 == sym)
+        return 0;
+    *result = tagged_atom(sym);
     return 1;
 }
 
@@ -761,41 +1051,116 @@ term tuple_of_list(ErlNifEnv *env, term head)
 
 
 #define HEAP_BIN_TAG(s) (TAG_HEADER_HEAP_BIN | ((s)<< TAG_HEADER_SIZE))
+#define REFC_BIN_TAG(s) (TAG_HEADER_REFC_BIN | ((s)<< TAG_HEADER_SIZE))
 
-term enif_make_binary(ErlNifEnv *env, ErlNifBinary *bin)
+static struct refc_binary *new_refc_binary(size_t size)
 {
-    /* Right now, all our binaries are heap binaries. */
-    term *p = alloc(env, sizeof(*p) + bin->size);
-    memcpy(p+1, bin->data, bin->size);
-    p[0] = HEAP_BIN_TAG(bin->size);
-    return box(p);
+    struct refc_binary *rb = malloc(sizeof(*rb) + size);
+    if (NULL == rb)
+        return NULL;
+    rb->refc = 1;
+    return rb;
 }
 
 
-term enif_make_sub_binary(ErlNifEnv *env, term bin_term, size_t pos, size_t size)
+static void release_refc_binary(struct refc_binary *rb)
+{
+    assert(rb->refc > 0);
+    if (0 == __atomic_sub_fetch(&rb->refc, 1, __ATOMIC_ACQ_REL))
+        free(rb);
+}
+
+
+/* Takes over a reference to val from the caller. */
+static term make_proc_bin(ErlNifEnv *env, struct refc_binary *val,
+                          unsigned char *bytes, size_t size)
+{
+    if (!env) env = &global;
+    struct proc_bin *pb = alloc(env, sizeof(*pb));
+    *pb = (struct proc_bin){
+        .header = REFC_BIN_TAG(size),
+        .val = val,
+        .bytes = bytes,
+        .next = env->off_heap
+    };
+    env->off_heap = pb;
+    return box(pb);
+}
+
+
+static term make_heap_bin(ErlNifEnv *env, const unsigned char *data, size_t size)
 {
-    /* XXX shouldn't allocate */
-    term *q = unbox(bin_term);
     term *p = alloc(env, sizeof(*p) + size);
-    memcpy(p+1, ((uint8_t *)(q+1))+pos, size);
+    if (size)
+        memcpy(p+1, data, size);
     p[0] = HEAP_BIN_TAG(size);
     return box(p);
 }
 
 
+/* As in ERTS, a binary from enif_alloc_binary is taken over rather
+ * than copied, and the caller must not release it afterwards. */
+term enif_make_binary(ErlNifEnv *env, ErlNifBinary *bin)
+{
+    struct refc_binary *rb = bin->ref_bin;
+    term t;
+
+    if (bin->size <= ONHEAP_BIN_LIMIT) {
+        t = make_heap_bin(env, bin->data, bin->size);
+        if (rb)
+            release_refc_binary(rb);
+    } else if (rb)
+        t = make_proc_bin(env, rb, bin->data, bin->size);
+    else {
+        if (NULL == (rb = new_refc_binary(bin->size)))
+            abort();
+        memcpy(rb->data, bin->data, bin->size);
+        t = make_proc_bin(env, rb, rb->data, bin->size);
+    }
+    bin->ref_bin = NULL;
+    return t;
+}
+
+
+term enif_make_sub_binary(ErlNifEnv *env, term bin_term, size_t pos, size_t size)
+{
+    term *q = unbox(bin_term);
+    uint8_t *data;
+    size_t len;
+    if (!binary_bytes(q, &data, &len))
+        return enif_make_badarg(env);
+    assert(pos <= len && size <= len - pos);
+    if (TAG_HEADER_REFC_BIN != (q[0] & TAG_HEADER))
+        return make_heap_bin(env, data+pos, size);
+    struct proc_bin *parent = (struct proc_bin *)q;
+    __atomic_add_fetch(&parent->val->refc, 1, __ATOMIC_RELAXED);
+    return make_proc_bin(env, parent->val, data+pos, size);
+}
+
+
 unsigned char *enif_make_new_binary(ErlNifEnv *env, size_t size, term *termp)
 {
-    /* XXX */
-    term *p = alloc(env, sizeof(*p) + size);
-    p[0] = HEAP_BIN_TAG(size);
-    if (termp) *termp = box(p);
-    return (unsigned char *)(p+1);
+    if (size <= ONHEAP_BIN_LIMIT) {
+        term *p = alloc(env, sizeof(*p) + size);
+        p[0] = HEAP_BIN_TAG(size);
+        if (termp) *termp = box(p);
+        return (unsigned char *)(p+1);
+    }
+    struct refc_binary *rb = new_refc_binary(size);
+    if (NULL == rb)
+        return NULL;
+    term t = make_proc_bin(env, rb, rb->data, size);
+    if (termp) *termp = t;
+    return rb->data;
 }
 
 
 void enif_release_binary(ErlNifBinary *bin)
 {
-    free(bin->data);
+    /* Binaries from enif_inspect_binary don't hold a reference. */
+    if (bin->ref_bin)
+        release_refc_binary(bin->ref_bin);
+    bin->ref_bin = NULL;
     bin->data = NULL;
     bin->size = 0;
 }
@@ -805,11 +1170,13 @@ int enif_inspect_binary(ErlNifEnv *UNUSED, term t, ErlNifBinary *bin)
 {
     if (TAG_PRIMARY_BOXED != (t & TAG_PRIMARY))
         return 0;
-    term *p = unbox(t);
-    if (TAG_HEADER_HEAP_BIN != (*p & TAG_HEADER))
+    uint8_t *data;
+    size_t size;
+    if (!binary_bytes(unbox(t), &data, &size))
         return 0;
-    bin->size = *p >> TAG_HEADER_SIZE;
-    bin->data = (unsigned char *)(p+1);
+    bin->size = size;
+    bin->data = data;
+    bin->ref_bin = NULL;
     return 1;
 }
 
@@ -818,7 +1185,7 @@ int enif_inspect_binary(ErlNifEnv *UNUSED, term t, ErlNifBinary *bin)
 int enif_inspect_iolist_as_binary(ErlNifEnv *env, term t, ErlNifBinary *bin)
 {
     term u;
-    if (!iolist_to_binary(t, &u))
+    if (!iolist_to_binary(env, t, &u))
         return 0;
     return enif_inspect_binary(env, u, bin);
 }
@@ -826,9 +1193,11 @@ int enif_inspect_iolist_as_binary(ErlNifEnv *env, term t, ErlNifBinary *bin)
 
 int enif_alloc_binary(size_t size, ErlNifBinary *bin)
 {
-    bin->data = malloc(size);
-    if (size && NULL == bin->data)
+    struct refc_binary *rb = new_refc_binary(size);
+    if (NULL == rb)
         return 0;
+    bin->ref_bin = rb;
+    bin->data = rb->data;
     bin->size = size;
     return 1;
 }
@@ -836,10 +1205,20 @@ int enif_alloc_binary(size_t size, ErlNifBinary *bin)
 
 int enif_realloc_binary(ErlNifBinary *bin, size_t size)
 {
-    unsigned char *p = realloc(bin->data, size);
-    if (size && NULL == p)
+    struct refc_binary *rb = bin->ref_bin;
+    if (NULL == rb) {
+        ErlNifBinary fresh;
+        if (!enif_alloc_binary(size, &fresh))
+            return 0;
+        memcpy(fresh.data, bin->data, size < bin->size ? size : bin->size);
+        *bin = fresh;
+        return 1;
+    }
+    assert(1 == rb->refc);
+    if (NULL == (rb = realloc(rb, sizeof(*rb) + size)))
         return 0;
-    bin->data = p;
+    bin->ref_bin = rb;
+    bin->data = rb->data;
     bin->size = size;
     return 1;
 }
@@ -864,22 +1243,72 @@ void enif_free(void *p)
 }
 
 
-void *enif_alloc_resource(ErlNifResourceType *UNUSED, size_t size)
+/* Resources are reference counted as in ERTS: one reference for the
+ * NIF from enif_alloc_resource, and one for every environment holding
+ * a term that refers to it.  NIF threads keep and release them too,
+ * so the counts are atomic. */
+struct resource {
+    size_t refc;
+    ErlNifResourceType *type;
+    char data[];
+};
+
+#define resource_of_obj(obj) ((struct resource *)((char *)(obj) - offsetof(struct resource, data)))
+
+struct enif_resource_type_t {
+    ErlNifResourceDtor *dtor;
+    ErlNifResourceStop *stop;
+    struct enif_resource_type_t *next;
+};
+
+static ErlNifResourceType *resource_types;
+
+
+__attribute__((destructor))
+static void free_resource_types(void)
+{
+    for (ErlNifResourceType *t = resource_types, *n; t; t = n) {
+        n = t->next;
+        free(t);
+    }
+    resource_types = NULL;
+}
+
+
+void *enif_alloc_resource(ErlNifResourceType *type, size_t size)
 {
-    return malloc(size);
+    struct resource *r = malloc(sizeof(*r) + size);
+    if (NULL == r)
+        return NULL;
+    r->refc = 1;
+    r->type = type;
+    return r->data;
 }
 
 
-void enif_release_resource(void *UNUSED)
+void enif_keep_resource(void *obj)
 {
-    /* XXX We don't free the resource here, because you're supposed to have tracked it with enif_make_resource; however, it would behoove us to still have  */
+    __atomic_add_fetch(&resource_of_obj(obj)->refc, 1, __ATOMIC_RELAXED);
+}
+
+
+void enif_release_resource(void *obj)
+{
+    struct resource *r = resource_of_obj(obj);
+    assert(__atomic_load_n(&r->refc, __ATOMIC_RELAXED) > 0);
+    if (__atomic_sub_fetch(&r->refc, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (r->type && r->type->dtor)
+        r->type->dtor(NULL, obj);
+    free(r);
 }
 
 
 term enif_make_resource(ErlNifEnv *env, void *obj)
 {
-    if (!track_freeable_pointer(env, obj))
+    if (!track_resource(env, obj))
         abort();
+    enif_keep_resource(obj);
     term *p = alloc(env, sizeof(*p) + sizeof(obj));
     *p = TAG_HEADER_EXTERNAL_REF;
     void **q = (void **)(p+1);
@@ -1033,34 +1462,130 @@ int enif_get_string(ErlNifEnv *UNUSED, term t, char *buf, unsigned size,
 }
 
 
-/*
- * FUNCTIONS WHOSE IMPLEMENTATION IS PATHOLOGICAL
- */
+/* Like a reduction budget, but in wall time: 1ms by default, as
+ * ERTS's scheduler aims for. */
+static uint64_t timeslice_ns = 1000000;
+
+void set_timeslice(uint64_t ns)
+{
+    timeslice_ns = ns ? ns : 1;
+}
 
 
-ErlNifPid *enif_self(ErlNifEnv *UNUSED, ErlNifPid *pid)
+void timeslice_begin(ErlNifEnv *env, uint64_t now)
 {
-    assert(pid);
-    pid->pid = 1;
-    return pid;
+    env->timeslice_start = now;
+    env->timeslice_percent = 0;
 }
 
 
+/* The slices a call has used so far, by the clock or by its own
+ * account, whichever is more. */
+unsigned timeslices_used(ErlNifEnv *env, uint64_t now)
+{
+    uint64_t by_clock = (now - env->timeslice_start + timeslice_ns - 1) / timeslice_ns;
+    uint64_t by_report = (env->timeslice_percent + 99) / 100;
+    uint64_t n = by_clock > by_report ? by_clock : by_report;
+    return n ? n : 1;
+}
+
+
+int enif_consume_timeslice(ErlNifEnv *env, int percent)
+{
+    if (percent < 1)
+        percent = 1;
+    else if (percent > 100)
+        percent = 100;
+    env->timeslice_percent += percent;
+    return env->timeslice_percent >= 100 ||
+        monotonic_ns() - env->timeslice_start >= timeslice_ns;
+}
+
+
+/* Set on the threads in dirty.c's pools. */
+__thread bool on_dirty_scheduler_p;
+
 int enif_is_on_dirty_scheduler(ErlNifEnv *UNUSED)
 {
-    return 1;                   /* why not? */
+    return on_dirty_scheduler_p;
+}
+
+
+/* The arguments are kept in env, which the caller doesn't clear until
+ * the continuation has finished. */
+term enif_schedule_nif(ErlNifEnv *env, const char *name, int flags,
+                       term (*fptr)(ErlNifEnv *, int, const term[]),
+                       int argc, const term argv[])
+{
+    if (NULL == fptr || argc < 0 ||
+        flags & ~(ERL_NIF_DIRTY_JOB_CPU_BOUND | ERL_NIF_DIRTY_JOB_IO_BOUND))
+        return enif_make_badarg(env);
+    term *copy = alloc(env, (argc ? argc : 1) * sizeof(*copy));
+    if (argc)
+        memcpy(copy, argv, argc * sizeof(*copy));
+    env->scheduled = (struct scheduled_nif){
+        .name = name, .flags = flags, .fptr = fptr, .argc = argc, .argv = copy
+    };
+    return THE_NON_VALUE;
+}
+
+
+bool take_scheduled_nif(ErlNifEnv *env, struct scheduled_nif *next)
+{
+    if (NULL == env->scheduled.fptr)
+        return false;
+    *next = env->scheduled;
+    env->scheduled = (struct scheduled_nif){0};
+    return true;
 }
 
 
+/*
+ * FUNCTIONS WHOSE IMPLEMENTATION IS PATHOLOGICAL
+ */
+
+
+
 ErlNifResourceType *
 enif_open_resource_type(ErlNifEnv *UNUSED,
                         const char *UNUSED,
                         const char *UNUSED,
-                        ErlNifResourceDtor *UNUSED,
+                        ErlNifResourceDtor *dtor,
                         ErlNifResourceFlags flags, ErlNifResourceFlags *tried)
 {
+    ErlNifResourceType *type = malloc(sizeof(*type));
+    if (NULL == type)
+        return NULL;
+    *type = (ErlNifResourceType){.dtor = dtor, .next = resource_types};
+    resource_types = type;
     if (tried) *tried = flags;
-    return NULL;
+    return type;
+}
+
+
+ErlNifResourceType *
+enif_open_resource_type_x(ErlNifEnv *env,
+                          const char *name,
+                          const ErlNifResourceTypeInit *init,
+                          ErlNifResourceFlags flags, ErlNifResourceFlags *tried)
+{
+    ErlNifResourceType *type = enif_open_resource_type(env, NULL, name, init->dtor,
+                                                       flags, tried);
+    if (type)
+        type->stop = init->stop;
+    return type;
+}
+
+
+/* For enif_select: calls the stop callback of obj's type, if it has
+ * one. */
+bool resource_stop(ErlNifEnv *env, void *obj, ErlNifEvent event, bool direct_p)
+{
+    ErlNifResourceType *type = resource_of_obj(obj)->type;
+    if (NULL == type || NULL == type->stop)
+        return false;
+    type->stop(env, obj, event, direct_p);
+    return true;
 }
 
 
@@ -1073,12 +1598,28 @@ term enif_make_ref(ErlNifEnv *UNUSED)
 
 ErlNifEnv *enif_alloc_env(void)
 {
-    /* XXX unimplemented */
     struct enif_environment_t *env = calloc(1, sizeof(*env));
     return env;
 }
 
 
+/* Statements run in environments that are cleared rather than freed,
+ * so the arena's last chunk gets reused. */
+void enif_clear_env(ErlNifEnv *env)
+{
+    if (!env) env = &global;
+    for (struct alloc *ap = env->allocations; ap; ap = ap->next)
+        enif_release_resource(ap->p);
+    env->allocations = NULL;
+    for (struct proc_bin *pb = env->off_heap; pb; pb = pb->next)
+        release_refc_binary(pb->val);
+    env->off_heap = NULL;
+    env->exception = THE_NON_VALUE;
+    env->scheduled = (struct scheduled_nif){0};
+    arena_clear(&env->heap);
+}
+
+
 void enif_free_env(ErlNifEnv *env)
 {
     bool global_p = false;
@@ -1086,12 +1627,8 @@ void enif_free_env(ErlNifEnv *env)
         env = &global;
         global_p = true;
     }
-    for (struct alloc *ap = env->allocations, *n; ap; ap = n) {
-        n = ap->next;
-        free(ap->p);
-        ap->p = NULL;
-        free(ap);
-    }
+    enif_clear_env(env);
+    arena_destroy(&env->heap);
     if (!global_p)
         free(env);
 }
@@ -1103,29 +1640,6 @@ void enif_free_env(ErlNifEnv *env)
  * REALLY UNIMPLEMENTED FUNCTIONS
  */
 
-int enif_thread_create(char *UNUSED, ErlNifTid *UNUSED,
-                       void *(_)(void *) __attribute__((unused)),
-                       void *UNUSED, ErlNifThreadOpts *UNUSED)
-{
-    abort();
-}
-
-
-int enif_thread_join(ErlNifTid UNUSED, void **UNUSED)
-{
-    abort();
-}
-
-
-int enif_send(ErlNifEnv *UNUSED, const ErlNifPid *UNUSED,
-              ErlNifEnv *UNUSED, term UNUSED)
-{
-    /* XXX unimplemented */
-    assert(0);
-    return 0;
-}
-
-
 int enif_map_iterator_create(ErlNifEnv *UNUSED,
                              term UNUSED,
                              ErlNifMapIterator *UNUSED,
@@ -1167,10 +1681,3 @@ int enif_map_iterator_get_pair(ErlNifEnv *UNUSED,
 {
     abort();
 }
-
-
-int enif_consume_timeslice(ErlNifEnv *UNUSED, int UNUSED)
-{
-    /* XXX should log */
-    return 0;
-}
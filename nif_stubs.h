@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "erl_nif.h"
+#include "arena.h"
 #include "map.h"
 #include "str.h"
 
@@ -13,6 +16,15 @@ struct alloc {
     struct alloc *next;
 };
 
+/* Where a NIF asked, with enif_schedule_nif, to be continued. */
+struct scheduled_nif {
+    const char *name;
+    int flags;
+    term (*fptr)(ErlNifEnv *, int, const term[]);
+    int argc;
+    const term *argv;
+};
+
 /* This should be called struct shared_object, but the way erl_nif.h
  * is written forces me to use this dumb name (which should not have a
  * trailing _t, and should be a typedef). */
@@ -22,9 +34,22 @@ struct enif_environment_t {
     /* The following items are non-NULL only if this SO is a NIF. */
     ErlNifEntry *entry;
     void *priv_data;
+    bool loaded_p;
+    int load_result;
     term exception;
-    struct atom_ptr_map fns;
+    /* Open-addressed on (function, arity); see niffy.c. */
+    struct fptr **fns;
+    size_t fns_mask, n_fns;
+    struct arena heap;
     struct alloc *allocations;
+    struct proc_bin *off_heap;
+    /* When the current call started, and how much of its timeslice
+     * it has owned up to with enif_consume_timeslice. */
+    uint64_t timeslice_start;
+    unsigned timeslice_percent;
+    struct scheduled_nif scheduled;
+    /* Whose behalf NIFs called in this env act on, for enif_self. */
+    struct process *process;
 };
 
 typedef enum {
@@ -32,7 +57,9 @@ typedef enum {
     TERM_SMALL,
     TERM_ATOM,
     TERM_NIL,
+    TERM_PID,
     TERM_IMMEDIATE,
+    TERM_VARIABLE,
     TERM_TUPLE,
     TERM_FLOAT,
     TERM_BIN,
@@ -48,10 +75,25 @@ void pretty_print_argument_list(FILE *, const term *);
 term tuple_of_list(ErlNifEnv *, term);
 extern term nconc(term, term);
 extern term nreverse_list(term);
-extern bool iolist_to_binary(term, term *);
+extern bool iolist_to_binary(ErlNifEnv *, term, term *);
 extern term_type type_of_term(const term);
 extern term tagged_atom(atom);
 extern atom atom_untagged(term);
+extern term make_pid(unsigned);
+extern unsigned pid_untagged(term);
+extern term tagged_variable(unsigned);
+extern unsigned variable_untagged(term);
+extern bool contains_variables(term);
+extern term substitute_variables(ErlNifEnv *, term, term (*)(void *, term), void *);
+extern term copy_substituting_variables(ErlNifEnv *, term, term (*)(void *, term), void *);
+
+extern bool resource_stop(ErlNifEnv *, void *, ErlNifEvent, bool);
+
+extern void set_timeslice(uint64_t);
+extern void timeslice_begin(ErlNifEnv *, uint64_t);
+extern unsigned timeslices_used(ErlNifEnv *, uint64_t);
+extern bool take_scheduled_nif(ErlNifEnv *, struct scheduled_nif *);
+extern __thread bool on_dirty_scheduler_p;
 
 extern const term nil;
 extern const unsigned max_atom_index;
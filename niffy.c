@@ -1,29 +1,64 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "erl_nif.h"
 
 #include "ast.h"
+#include "bench.h"
+#include "dirty.h"
+#include "histogram.h"
 #include "lex.h"
 #include "macrology.h"
 #include "niffy.h"
 #include "nif_stubs.h"
 #include "parse_protos.h"
+#include "perf.h"
+#include "process.h"
+#include "select.h"
+#include "threads.h"
 #include "variable.h"
 
 
 static struct atom_ptr_map modules;
 static atom default_module;
+/* NIFs are called in this environment, which is cleared at the end of
+ * every statement, like a process heap after a call returns. */
+static struct enif_environment_t call_env;
+static bool perf_counters_p;
+/* Where latency histograms are written, if we're keeping them. */
+static const char *latency_path;
+static volatile sig_atomic_t latency_dump_requested_p;
+static bool dump_latency(void);
+static bool timeslice_report_p;
+
+/* Counted per segment, for NIFs that reschedule themselves. */
+struct timeslice_totals {
+    unsigned long calls, segments, slices, overruns;
+    unsigned max;
+};
 
 struct fptr {
     unsigned arity;
     term (*fptr)(ErlNifEnv *env, int argc, const term argv[]);
-    struct fptr *next;
+    int flags;
+    struct enif_environment_t *module;
+    atom function;
+    struct perf_totals perf;
+    struct histogram *latency, *segment_latency;
+    unsigned long reschedules;
+    struct timeslice_totals timeslices;
 };
 
+/* Arguments for the statement being run, reused from one to the next. */
+static term *call_argv;
+static unsigned call_argv_avail;
+
 
 static struct enif_environment_t *find_module_or_die(atom module)
 {
@@ -43,9 +78,17 @@ static term bif_load_nif(ErlNifEnv *env, int argc, const term argv[])
     if (2 != argc)
         return enif_make_badarg(env);
 
+    static pthread_mutex_t loading = PTHREAD_MUTEX_INITIALIZER;
     struct enif_environment_t *m = find_module_or_die(atom_untagged(argv[0]));
     assert(NULL != m);
-    return enif_make_int(NULL, m->entry->load(m, &m->priv_data, argv[1]));
+    /* Only load once, so scripts can be replayed (as when fuzzing, or
+     * on several threads at once) without piling up priv_data. */
+    pthread_mutex_lock(&loading);
+    if (!m->loaded_p && m->entry->load)
+        m->load_result = m->entry->load(m, &m->priv_data, argv[1]);
+    m->loaded_p = true;
+    pthread_mutex_unlock(&loading);
+    return enif_make_int(NULL, m->load_result);
 }
 
 
@@ -74,9 +117,74 @@ static term bif_element(ErlNifEnv *env, int UNUSED, const term argv[])
 }
 
 
+/* niffy:bench(Module, Function, Args, N) */
+static term bif_bench(ErlNifEnv *env, int UNUSED, const term argv[])
+{
+    atom module, function;
+    unsigned len;
+    unsigned long n;
+    if (!enif_is_atom(env, argv[0]) || !enif_is_atom(env, argv[1]) ||
+        !enif_get_list_length(env, argv[2], &len) ||
+        !enif_get_ulong(env, argv[3], &n) || 0 == n)
+        return enif_make_badarg(env);
+    module = atom_untagged(argv[0]);
+    function = atom_untagged(argv[1]);
+
+    /* Not in env: that's the one bench clears between calls, if
+     * we're being benchmarked ourselves. */
+    term tuple = tuple_of_list(NULL, argv[2]);
+    int arity;
+    const term *args;
+    if (!enif_get_tuple(env, tuple, &arity, &args))
+        return enif_make_badarg(env);
+    struct fptr *f = niffy_resolve(module, function, arity);
+
+    struct bench_stats stats;
+    if (!bench(f, arity, args, n, NULL, NULL, &stats))
+        return enif_make_badarg(env);
+    return bench_stats_term(env, &stats);
+}
+
+
+static term bif_self(ErlNifEnv *env, int UNUSED, const term *UNUSED)
+{
+    ErlNifPid pid;
+    if (NULL == enif_self(env, &pid))
+        return enif_make_badarg(env);
+    return pid.pid;
+}
+
+
+/* niffy:receive(Timeout), with Timeout in milliseconds or infinity.
+ * Returns the atom timeout if no message came. */
+static term bif_receive(ErlNifEnv *env, int UNUSED, const term argv[])
+{
+    long timeout_ms;
+    term msg;
+    if (enif_is_identical(argv[0], enif_make_atom(env, "infinity")))
+        timeout_ms = -1;
+    else if (!enif_get_long(env, argv[0], &timeout_ms) || timeout_ms < 0)
+        return enif_make_badarg(env);
+    if (!process_receive(env, timeout_ms, &msg))
+        return enif_make_atom(env, "timeout");
+    return msg;
+}
+
+
+static term bif_dump_latency(ErlNifEnv *env, int UNUSED, const term *UNUSED)
+{
+    if (NULL == latency_path || !dump_latency())
+        return enif_make_badarg(env);
+    return enif_make_atom(env, "ok");
+}
+
+
+/* Doesn't run exit handlers: the parser thread may still be interning
+ * atoms in the tables they'd free. */
 static term bif_halt(ErlNifEnv *UNUSED, int UNUSED, const term *UNUSED)
 {
-    exit(0);
+    fflush(NULL);
+    _exit(0);
 }
 
 
@@ -106,14 +214,76 @@ static term bif_assert_ne(ErlNifEnv *UNUSED, int UNUSED, const term argv[])
 }
 
 
-static struct fptr *find_fn_or_die(struct enif_environment_t *m, atom fn, unsigned arity)
+/* Each module's functions are in a flat table, hashed on name and
+ * arity together and probed linearly, at most half full; finding one
+ * is usually a single probe. */
+static size_t fn_slot(const struct enif_environment_t *m, atom fn, unsigned arity)
+{
+    uint32_t h = fn * 2654435761u ^ arity * 0x85ebca6bu;
+    return (h ^ h >> 15) & m->fns_mask;
+}
+
+
+static struct fptr *find_fn(const struct enif_environment_t *m, atom fn, unsigned arity)
 {
-    struct fptr *f = map_lookup(&m->fns, fn);
-    while (f) {
-        if (arity == f->arity)
+    if (NULL == m->fns)
+        return NULL;
+    for (size_t i = fn_slot(m, fn, arity);; i = (i+1) & m->fns_mask) {
+        struct fptr *f = m->fns[i];
+        if (NULL == f || (fn == f->function && arity == f->arity))
             return f;
-        f = f->next;
     }
+}
+
+
+static bool grow_fns(struct enif_environment_t *m)
+{
+    struct enif_environment_t old = *m;
+    size_t len = old.fns ? 2 * (old.fns_mask+1) : 8;
+    if (NULL == (m->fns = calloc(len, sizeof(*m->fns)))) {
+        m->fns = old.fns;
+        return false;
+    }
+    m->fns_mask = len - 1;
+    for (size_t i = 0; old.fns && i <= old.fns_mask; ++i) {
+        struct fptr *f = old.fns[i];
+        if (NULL == f)
+            continue;
+        size_t j = fn_slot(m, f->function, f->arity);
+        while (m->fns[j])
+            j = (j+1) & m->fns_mask;
+        m->fns[j] = f;
+    }
+    free(old.fns);
+    return true;
+}
+
+
+/* A later function with the same name and arity replaces an earlier
+ * one. */
+static bool add_fptr(struct enif_environment_t *m, struct fptr *f)
+{
+    if ((NULL == m->fns || 2 * (m->n_fns+1) > m->fns_mask+1) && !grow_fns(m))
+        return false;
+    size_t i = fn_slot(m, f->function, f->arity);
+    for (; m->fns[i]; i = (i+1) & m->fns_mask) {
+        if (f->function == m->fns[i]->function && f->arity == m->fns[i]->arity) {
+            free(m->fns[i]);
+            m->fns[i] = f;
+            return true;
+        }
+    }
+    m->fns[i] = f;
+    ++m->n_fns;
+    return true;
+}
+
+
+static struct fptr *find_fn_or_die(struct enif_environment_t *m, atom fn, unsigned arity)
+{
+    struct fptr *f = find_fn(m, fn, arity);
+    if (f)
+        return f;
     fprintf(stderr, "no match for function %s:", m->entry->name);
     pretty_print_atom(stderr, fn);
     fprintf(stderr, "/%u\n", arity);
@@ -122,35 +292,228 @@ static struct fptr *find_fn_or_die(struct enif_environment_t *m, atom fn, unsign
 }
 
 
-static term call(struct function_call *call)
+struct fptr *niffy_resolve(atom module, atom function, unsigned arity)
 {
-    atom module = call->module ? call->module : default_module;
-    struct enif_environment_t *m = find_module_or_die(module);
+    struct enif_environment_t *m = find_module_or_die(module ? module : default_module);
     assert(NULL != m);
-    term tuple = tuple_of_list(NULL, call->args);
-    unsigned arity;
-    const term *p;
-    assert(enif_get_tuple(NULL, tuple, (int *)&arity, &p));
-    struct fptr *f = find_fn_or_die(m, call->function, arity);
-    term result = f->fptr(m, arity, p);
-    if (m->exception) {
+    return find_fn_or_die(m, function, arity);
+}
+
+
+static void record_timeslices(struct timeslice_totals *t, unsigned slices)
+{
+    ++t->segments;
+    t->slices += slices;
+    if (slices > 1)
+        ++t->overruns;
+    if (slices > t->max)
+        t->max = slices;
+}
+
+
+term niffy_invoke_in(ErlNifEnv *env, struct fptr *f, unsigned argc, const term argv[])
+{
+    env->entry = f->module->entry;
+    env->priv_data = f->module->priv_data;
+    /* Counted a segment at a time, since dirty segments are counted on
+     * the dirty scheduler's own counters. */
+    struct perf_sample counted = {0}, before, after;
+    uint64_t start = monotonic_ns(), segment_start = start, end = start;
+    term (*fptr)(ErlNifEnv *, int, const term[]) = f->fptr;
+    int flags = f->flags;
+    term result;
+
+    /* A NIF that yields with enif_schedule_nif is called back, in
+     * the same env, until it returns something else. */
+    for (;;) {
+        timeslice_begin(env, segment_start);
+        if (dirty_p(flags))
+            result = dirty_call(flags, fptr, env, argc, argv,
+                                perf_counters_p ? &counted : NULL);
+        else {
+            if (perf_counters_p)
+                perf_read(&before);
+            result = fptr(env, argc, argv);
+            if (perf_counters_p) {
+                perf_read(&after);
+                perf_add(&counted, &before, &after);
+            }
+        }
+        if (latency_path || timeslice_report_p)
+            end = monotonic_ns();
+        if (latency_path && !histogram_record(&f->segment_latency, end - segment_start))
+            abort();
+        if (timeslice_report_p)
+            record_timeslices(&f->timeslices, timeslices_used(env, end));
+
+        struct scheduled_nif next;
+        if (!take_scheduled_nif(env, &next) || env->exception)
+            break;
+        __atomic_add_fetch(&f->reschedules, 1, __ATOMIC_RELAXED);
+        fptr = next.fptr;
+        flags = next.flags;
+        argc = next.argc;
+        argv = next.argv;
+        segment_start = end = monotonic_ns();
+    }
+
+    if (latency_path && !histogram_record(&f->latency, end - start))
+        abort();
+    if (timeslice_report_p)
+        ++f->timeslices.calls;
+    if (perf_counters_p)
+        perf_accumulate(&f->perf, &(struct perf_sample){0}, &counted);
+    if (env->exception) {
         fprintf(stderr, "raised exception ");
-        pretty_print_term(stderr, &m->exception);
+        pretty_print_term(stderr, &env->exception);
         fputc('\n', stderr);
         /* continuing cowardly */
-        m->exception = 0;
+        env->exception = 0;
     }
     return result;
 }
 
 
-static bool add_fn(struct atom_ptr_map *fm, const char *s, struct fptr fn)
+term niffy_invoke(struct fptr *f, unsigned argc, const term argv[])
+{
+    return niffy_invoke_in(&call_env, f, argc, argv);
+}
+
+
+void niffy_print_mfa(FILE *out, const struct fptr *f)
+{
+    fprintf(out, "%s:", f->module->entry->name);
+    pretty_print_atom(out, f->function);
+    fprintf(out, "/%u", f->arity);
+}
+
+
+/* Truncated to fit, if need be. */
+static void mfa_name(char *buf, size_t len, const struct fptr *f)
+{
+    FILE *out = fmemopen(buf, len, "w");
+    if (NULL == out) {
+        *buf = '\0';
+        return;
+    }
+    setbuf(out, NULL);
+    niffy_print_mfa(out, f);
+    fclose(out);
+}
+
+
+static void each_called_fn(void (*g)(struct fptr *))
+{
+    void each_module(struct atom_ptr_pair p) {
+        struct enif_environment_t *m = p.v;
+        for (size_t i = 0; m->fns && i <= m->fns_mask; ++i)
+            if (m->fns[i])
+                g(m->fns[i]);
+    }
+    map_iter(&modules, each_module);
+}
+
+
+/* JSON, unless the file is named *.csv. */
+static bool dump_latency(void)
+{
+    FILE *out = fopen(latency_path, "w");
+    if (NULL == out) {
+        perror(latency_path);
+        return false;
+    }
+    size_t len = strlen(latency_path);
+    bool csv_p = len >= 4 && 0 == strcmp(latency_path + len - 4, ".csv");
+    const char *sep = "";
+    void dump_fn(struct fptr *f) {
+        if (NULL == f->latency)
+            return;
+        char name[256];
+        mfa_name(name, sizeof(name), f);
+        if (csv_p) {
+            histogram_print_csv(out, name, "call", f->latency);
+            if (f->reschedules)
+                histogram_print_csv(out, name, "segment", f->segment_latency);
+            return;
+        }
+        fprintf(out, "%s\n  {\"function\": ", sep);
+        json_print_string(out, name);
+        fputs(", \"latency\": ", out);
+        histogram_print_json(out, f->latency);
+        if (f->reschedules) {
+            fprintf(out, ", \"reschedules\": %lu, \"segments\": ", f->reschedules);
+            histogram_print_json(out, f->segment_latency);
+        }
+        fputc('}', out);
+        sep = ",";
+    }
+    if (csv_p)
+        histogram_print_csv_header(out);
+    else
+        fputc('[', out);
+    each_called_fn(dump_fn);
+    if (!csv_p)
+        fputs("\n]\n", out);
+    return 0 == fclose(out);
+}
+
+
+static void request_latency_dump(int UNUSED)
+{
+    latency_dump_requested_p = 1;
+}
+
+
+/* Times every NIF call from now on, writing histograms to path at
+ * exit, on niffy:dump_latency(), or after a SIGUSR1. */
+bool niffy_enable_latency_histograms(const char *path)
+{
+    latency_path = path;
+    struct sigaction sa = {.sa_handler = request_latency_dump};
+    sigemptyset(&sa.sa_mask);
+    return 0 == sigaction(SIGUSR1, &sa, NULL);
+}
+
+
+/* Anything worth keeping has been copied into variables by now; the
+ * arguments and the results can all go. */
+void niffy_end_statement(void)
+{
+    if (latency_dump_requested_p) {
+        latency_dump_requested_p = 0;
+        dump_latency();
+    }
+    enif_clear_env(&call_env);
+    enif_clear_env(NULL);
+    variable_gc();
+}
+
+
+static term call(struct function_call *call)
+{
+    unsigned arity = 0;
+    term head, tail = call->args;
+    for (; enif_get_list_cell(NULL, tail, &head, &tail); ++arity) {
+        if (arity == call_argv_avail) {
+            call_argv_avail = call_argv_avail ? 2 * call_argv_avail : 8;
+            if (NULL == (call_argv = realloc(call_argv, call_argv_avail * sizeof(*call_argv))))
+                abort();
+        }
+        call_argv[arity] = variable_substitute(NULL, head);
+    }
+    return niffy_invoke(niffy_resolve(call->module, call->function, arity), arity, call_argv);
+}
+
+
+static bool add_fn(struct enif_environment_t *e, const char *s, struct fptr fn)
 {
-    atom sym = intern_cstr(s);
     struct fptr *f = malloc(sizeof(*f));
-    fn.next = map_lookup(fm, sym);
+    if (NULL == f)
+        return false;
+    fn.module = e;
+    fn.function = intern_cstr(s);
     *f = fn;
-    return map_insert(fm, sym, f);
+    return add_fptr(e, f);
 }
 
 
@@ -168,10 +531,15 @@ void niffy_construct_erlang_env(void)
     };
     assert(map_insert(&modules, intern_cstr(e->entry->name), e));
 
-    assert(add_fn(&e->fns, "load_nif", (struct fptr){.arity = 2, .fptr = bif_load_nif}));
-    assert(add_fn(&e->fns, "halt", (struct fptr){.arity = 0, .fptr = bif_halt}));
-    assert(add_fn(&e->fns, "byte_size", (struct fptr){.arity = 1, .fptr = bif_byte_size}));
-    assert(add_fn(&e->fns, "element", (struct fptr){.arity = 2, .fptr = bif_element}));
+    assert(add_fn(e, "load_nif", (struct fptr){.arity = 2, .fptr = bif_load_nif}));
+    assert(add_fn(e, "halt", (struct fptr){.arity = 0, .fptr = bif_halt}));
+    assert(add_fn(e, "byte_size", (struct fptr){.arity = 1, .fptr = bif_byte_size}));
+    assert(add_fn(e, "element", (struct fptr){.arity = 2, .fptr = bif_element}));
+    assert(add_fn(e, "bench", (struct fptr){.arity = 4, .fptr = bif_bench}));
+    assert(add_fn(e, "dump_latency", (struct fptr){.arity = 0, .fptr = bif_dump_latency}));
+    assert(add_fn(e, "self", (struct fptr){.arity = 0, .fptr = bif_self}));
+    assert(add_fn(e, "receive", (struct fptr){.arity = 1, .fptr = bif_receive}));
+    call_env.process = process_main();
 }
 
 
@@ -188,8 +556,8 @@ void niffy_construct_assert_env(void)
     };
     assert(map_insert(&modules, intern_cstr(e->entry->name), e));
 
-    assert(add_fn(&e->fns, "eq", (struct fptr){.arity = 2, .fptr = bif_assert_eq}));
-    assert(add_fn(&e->fns, "ne", (struct fptr){.arity = 2, .fptr = bif_assert_ne}));
+    assert(add_fn(e, "eq", (struct fptr){.arity = 2, .fptr = bif_assert_eq}));
+    assert(add_fn(e, "ne", (struct fptr){.arity = 2, .fptr = bif_assert_ne}));
 }
 
 
@@ -206,6 +574,7 @@ void niffy_handle_statement(struct statement *st)
 
     case AST_ST_V_OF_TERM:
         enif_get_list_cell(NULL, st->call.args, &result, NULL);
+        result = variable_substitute(NULL, result);
         assert(variable_assign(st->variable, result));
         break;
 
@@ -226,12 +595,16 @@ void niffy_handle_statement(struct statement *st)
         putchar('\n');
         break;
     }
+
+    niffy_end_statement();
 }
 
 
 bool niffy_load_so(const char *path, int rtld_mode, int verbosity)
 {
     struct enif_environment_t *s = calloc(1, sizeof(*s));
+    if (NULL == s)
+        return false;
     s->path = path;
 
     s->dl_handle = dlopen(s->path, rtld_mode);
@@ -256,34 +629,117 @@ bool niffy_load_so(const char *path, int rtld_mode, int verbosity)
     for (int i = 0; i < s->entry->num_of_funcs; ++i) {
         if (verbosity > 1)
             printf("  %s/%d\n", s->entry->funcs[i].name, s->entry->funcs[i].arity);
-        atom sym = intern_cstr(s->entry->funcs[i].name);
         struct fptr *f = malloc(sizeof(*f));
-        *f = (struct fptr){.arity = s->entry->funcs[i].arity,
-                           .fptr = s->entry->funcs[i].fptr,
-                           .next = map_lookup(&s->fns, sym)};
-        map_insert(&s->fns, sym, f);
+        if (f)
+            *f = (struct fptr){.arity = s->entry->funcs[i].arity,
+                               .fptr = s->entry->funcs[i].fptr,
+                               .flags = s->entry->funcs[i].flags,
+                               .module = s,
+                               .function = intern_cstr(s->entry->funcs[i].name)};
+        if (NULL == f || !add_fptr(s, f)) {
+            free(f);
+            fprintf(stderr, "%s: couldn't add %s/%d\n", s->path,
+                    s->entry->funcs[i].name, s->entry->funcs[i].arity);
+            return false;
+        }
     }
     return true;
 }
 
 
-void niffy_destroy_environments(void)
+/* Counts every NIF call from now on, reporting at exit. */
+bool niffy_enable_perf_counters(void)
 {
-    void free_fn_v(struct atom_ptr_pair p) {
-        for (struct fptr *f = p.v, *g; f; f = g) {
-            g = f->next;
-            free(f);
-        }
+    return perf_counters_p = perf_open();
+}
+
+
+/* Counts the timeslices (of ns nanoseconds) each call uses, reporting
+ * at exit. */
+void niffy_enable_timeslice_report(uint64_t ns)
+{
+    set_timeslice(ns);
+    timeslice_report_p = true;
+}
+
+
+static void report_timeslices(FILE *out)
+{
+    void print_fn(struct fptr *f) {
+        const struct timeslice_totals *t = &f->timeslices;
+        if (0 == t->calls)
+            return;
+        char name[41];
+        mfa_name(name, sizeof(name), f);
+        fprintf(out, "%-40s %10lu %10lu %14.2f %10u %12lu\n", name, t->calls,
+                t->segments, (double)t->slices / t->segments, t->max, t->overruns);
     }
+    fprintf(out, "%-40s %10s %10s %14s %10s %12s\n", "function", "calls",
+            "segments", "slices/segment", "max", "over budget");
+    each_called_fn(print_fn);
+}
+
+
+static void report_perf_counters(FILE *out)
+{
+    void print_fn(struct fptr *f) {
+        if (0 == f->perf.calls)
+            return;
+        char name[41];
+        mfa_name(name, sizeof(name), f);
+        fprintf(out, "%-40s", name);
+        perf_print(out, &f->perf);
+    }
+    perf_print_header(out);
+    each_called_fn(print_fn);
+}
+
+
+void niffy_destroy_environments(void)
+{
     void free_mp_v(struct atom_ptr_pair p) {
         struct enif_environment_t *e = p.v;
-        map_iter(&e->fns, free_fn_v);
-        map_destroy(&e->fns);
-        if (e->dl_handle)
-            dlclose(e->dl_handle);
+        void *dl_handle = e->dl_handle;
+        for (size_t i = 0; e->fns && i <= e->fns_mask; ++i) {
+            struct fptr *f = e->fns[i];
+            if (NULL == f)
+                continue;
+            free(f->latency);
+            free(f->segment_latency);
+            free(f);
+        }
+        free(e->fns);
         enif_free_env(e);
+        if (dl_handle)
+            dlclose(dl_handle);
+    }
+    dirty_stop();
+    select_stop();
+    if (perf_counters_p) {
+        report_perf_counters(stderr);
+        perf_close();
+        perf_counters_p = false;
     }
+    if (latency_path) {
+        dump_latency();
+        latency_path = NULL;
+    }
+    if (timeslice_report_p) {
+        report_timeslices(stderr);
+        timeslice_report_p = false;
+    }
+    /* Resource destructors live in the NIFs, so release terms before
+     * unloading anything. */
+    process_destroy_all();
+    variable_destroy();
+    enif_clear_env(&call_env);
+    arena_destroy(&call_env.heap);
+    enif_free_env(NULL);
+    free(call_argv);
+    call_argv = NULL;
+    call_argv_avail = 0;
     map_iter(&modules, free_mp_v);
     map_destroy(&modules);
-    enif_free_env(NULL);
+    lock_profile_report(stderr);
+    lock_profile_destroy();
 }
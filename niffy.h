@@ -7,4 +7,13 @@ extern void niffy_construct_erlang_env(void);
 extern void niffy_construct_assert_env(void);
 extern bool niffy_load_so(const char *, int, int);
 extern void niffy_handle_statement(struct statement *);
+struct fptr;
+extern struct fptr *niffy_resolve(atom, atom, unsigned);
+extern term niffy_invoke(struct fptr *, unsigned, const term[]);
+extern term niffy_invoke_in(ErlNifEnv *, struct fptr *, unsigned, const term[]);
+extern void niffy_print_mfa(FILE *, const struct fptr *);
+extern void niffy_end_statement(void);
+extern bool niffy_enable_perf_counters(void);
+extern bool niffy_enable_latency_histograms(const char *);
+extern void niffy_enable_timeslice_report(uint64_t);
 extern void niffy_destroy_environments(void);
@@ -14,7 +14,6 @@
   #include "ast.h"
   #include "lex.h"
   #include "nif_stubs.h"
-  #include "variable.h"
 
   typedef void (*callback)(struct statement *);
 }
@@ -88,7 +87,7 @@ list(L) ::= LBRACKET terms(A) PIPE term(T) RBRACKET. { L = nreverse_list(enif_ma
 binary(B) ::= LBIN RBIN. {
     B = enif_make_binary(NULL, &(ErlNifBinary){.size = 0, .data = NULL});
 }
-binary(B) ::= LBIN bin_elts(Es) RBIN. { assert(iolist_to_binary(nreverse_list(Es), &B)); }
+binary(B) ::= LBIN bin_elts(Es) RBIN. { assert(iolist_to_binary(NULL, nreverse_list(Es), &B)); }
 
 bin_elts(E) ::= bin_elts(Hs) COMMA bin_elt(T). { E = enif_make_list_cell(NULL, T, Hs); }
 bin_elts(E) ::= bin_elt(H). { E = enif_make_list(NULL, 1, H); }
@@ -126,7 +125,7 @@ atomic(A) ::= CHAR(C). { A = enif_make_int(NULL, C.char_value); }
 atomic(A) ::= INTEGER(I). { A = enif_make_int(NULL, I.int64_value); }
 atomic(A) ::= FLOAT(F). { A = enif_make_double(NULL, F.float_value); }
 atomic(A) ::= ATOM(T). { A = tagged_atom(T.atom_value); }
-atomic(A) ::= VARIABLE(V). { A = variable_lookup(V.atom_value); }
+atomic(A) ::= VARIABLE(V). { A = tagged_variable(V.atom_value); }
 atomic(A) ::= strings(S). { A = S; }
 
 strings(S) ::= STRING(T). {
@@ -1,6 +1,7 @@
 
 #include <assert.h>
 
+#include "input.h"
 #include "lex.h"
 #include "parse_protos.h"
 #include "str.h"
@@ -14,7 +15,8 @@ static void pretty_print_mfa(struct function_call *call)
         fputc(':', stdout);
     }
     pretty_print_atom(stdout, call->function);
-    pretty_print_argument_list(stdout, &call->args);
+    term args = variable_substitute(NULL, call->args);
+    pretty_print_argument_list(stdout, &args);
 }
 
 
@@ -31,6 +33,7 @@ static void print(struct statement *st)
         fputs(" = ", stdout);
         term head;
         enif_get_list_cell(NULL, st->call.args, &head, NULL);
+        head = variable_substitute(NULL, head);
         pretty_print_term(stdout, &head);
         puts(".");
         assert(variable_assign(st->variable, head));
@@ -56,25 +59,23 @@ static void print(struct statement *st)
 }
 
 
-int main()
+static void parse_token(void *pParser, struct token *token)
+{
+    Parse(pParser, token->type, *token, print);
+}
+
+
+/* an argument sets the size of the blocks a pipe is read in */
+int main(int argc, char **argv)
 {
-    FILE *in = stdin;
-    char *line = NULL;
-    size_t line_len = 0;
     struct lexer lexer;
     lex_init(&lexer);
     void *pParser;
 
+    if (argc > 1)
+        input_set_block_size(strtoul(argv[1], NULL, 10));
     pParser = ParseAlloc(malloc);
-    ssize_t nread = 0;
-    while (-1 != (nread = getline(&line, &line_len, in))) {
-        lex_setup_next_line(&lexer, line, nread, feof(in));
-        struct token token;
-
-        while (lex(&lexer, &token))
-            Parse(pParser, token.type, token, print);
-    }
+    lex_input(stdin, &lexer, parse_token, pParser);
     Parse(pParser, 0, (struct token){.type = 0, .location = lexer.location}, print);
-    free(line);
     ParseFree(pParser, free);
 }
@@ -0,0 +1,175 @@
+/* Hardware performance counters
+ *
+ * A group of counters for each thread that runs NIFs (the main thread,
+ * and any dirty scheduler that's been given a counted job), counting
+ * user space only, read before and after each NIF call.  Each read is a syscall
+ * whose return path lands in the sample, so for very small NIFs
+ * compare calls with one another rather than trusting the absolute
+ * figures.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERF_N_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {"L1d misses", PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D |
+                         PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                         PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    [PERF_LLC_MISSES] = {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* The calling thread's group.  Where each counter appears in a group
+ * read, or -1 if the CPU (or the kernel's paranoia) wouldn't let us
+ * have it. */
+static __thread int index_of[PERF_N_COUNTERS];
+static __thread int fds[PERF_N_COUNTERS];
+static __thread int leader = -1;
+static __thread unsigned n_open;
+
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+
+/* Opens a group counting the calling thread. */
+bool perf_open(void)
+{
+    for (int i = 0; i < PERF_N_COUNTERS; ++i) {
+        struct perf_event_attr attr = {
+            .type = events[i].type,
+            .size = sizeof(attr),
+            .config = events[i].config,
+            .disabled = leader < 0,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+        };
+        fds[i] = perf_event_open(&attr, leader);
+        index_of[i] = fds[i] < 0 ? -1 : (int)n_open++;
+        if (fds[i] < 0 && leader < 0) {
+            fprintf(stderr, "perf_event_open(%s): %s\n", events[i].name, strerror(errno));
+            return false;
+        }
+        if (leader < 0)
+            leader = fds[i];
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+
+void perf_read(struct perf_sample *s)
+{
+    uint64_t buf[3 + PERF_N_COUNTERS];
+    if (read(leader, buf, sizeof(buf)) < (ssize_t)((3 + n_open) * sizeof(*buf))) {
+        *s = (struct perf_sample){0};
+        return;
+    }
+    s->enabled = buf[1];
+    s->running = buf[2];
+    for (int i = 0; i < PERF_N_COUNTERS; ++i)
+        s->counts[i] = index_of[i] < 0 ? 0 : buf[3 + index_of[i]];
+}
+
+
+void perf_close(void)
+{
+    for (int i = 0; i < PERF_N_COUNTERS; ++i)
+        if (index_of[i] >= 0)
+            close(fds[i]);
+    leader = -1;
+    n_open = 0;
+}
+
+#else
+
+static __thread int index_of[PERF_N_COUNTERS];
+
+bool perf_open(void)
+{
+    fprintf(stderr, "hardware counters are only supported on Linux\n");
+    return false;
+}
+
+void perf_read(struct perf_sample *s) { *s = (struct perf_sample){0}; }
+void perf_close(void) {}
+
+#endif
+
+
+/* Adds what was counted between before and after to sum. */
+void perf_add(struct perf_sample *sum, const struct perf_sample *before,
+              const struct perf_sample *after)
+{
+    sum->enabled += after->enabled - before->enabled;
+    sum->running += after->running - before->running;
+    for (int i = 0; i < PERF_N_COUNTERS; ++i)
+        sum->counts[i] += after->counts[i] - before->counts[i];
+}
+
+
+/* If the group was multiplexed off the PMU for any part of the call,
+ * its counts are partial, so we only count the call. */
+void perf_accumulate(struct perf_totals *t, const struct perf_sample *before,
+                     const struct perf_sample *after)
+{
+    ++t->calls;
+    if (after->running - before->running != after->enabled - before->enabled) {
+        ++t->unscheduled;
+        return;
+    }
+    for (int i = 0; i < PERF_N_COUNTERS; ++i)
+        t->counts[i] += after->counts[i] - before->counts[i];
+}
+
+
+void perf_print_header(FILE *out)
+{
+    fprintf(out, "%-40s %10s %12s %12s %6s %10s %10s %10s\n", "function", "calls",
+            "cycles", "instrs", "IPC", "L1d-miss", "LLC-miss", "br-miss");
+}
+
+
+/* Per-call averages, over the calls that were counted throughout. */
+void perf_print(FILE *out, const struct perf_totals *t)
+{
+    unsigned long n = t->calls - t->unscheduled;
+    void column(enum perf_counter c, int width) {
+        if (index_of[c] < 0)
+            fprintf(out, " %*s", width, "-");
+        else
+            fprintf(out, " %*.1f", width, n ? (double)t->counts[c] / n : 0);
+    }
+    fprintf(out, " %10lu", t->calls);
+    column(PERF_CYCLES, 12);
+    column(PERF_INSTRUCTIONS, 12);
+    if (index_of[PERF_INSTRUCTIONS] < 0 || 0 == t->counts[PERF_CYCLES])
+        fprintf(out, " %6s", "-");
+    else
+        fprintf(out, " %6.2f", (double)t->counts[PERF_INSTRUCTIONS] / t->counts[PERF_CYCLES]);
+    for (int i = PERF_L1D_MISSES; i < PERF_N_COUNTERS; ++i)
+        column(i, 10);
+    if (t->unscheduled)
+        fprintf(out, "  (%lu calls not counted)", t->unscheduled);
+    fputc('\n', out);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_N_COUNTERS
+};
+
+struct perf_totals {
+    unsigned long calls, unscheduled;
+    uint64_t counts[PERF_N_COUNTERS];
+};
+
+struct perf_sample {
+    uint64_t enabled, running;
+    uint64_t counts[PERF_N_COUNTERS];
+};
+
+extern bool perf_open(void);
+extern void perf_read(struct perf_sample *);
+extern void perf_add(struct perf_sample *, const struct perf_sample *,
+                     const struct perf_sample *);
+extern void perf_accumulate(struct perf_totals *, const struct perf_sample *,
+                            const struct perf_sample *);
+extern void perf_print_header(FILE *);
+extern void perf_print(FILE *, const struct perf_totals *);
+extern void perf_close(void);
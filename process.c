@@ -0,0 +1,260 @@
+/* Emulated processes
+ *
+ * Just enough of a process for NIFs that talk to their callers: a pid
+ * and a mailbox.  The script runs as one process, and with --threads
+ * each thread is another.  An env knows which process it's running
+ * for, so enif_self works, and enif_send copies the message into an
+ * env of its own and puts it in the receiver's mailbox, from any
+ * thread, including those the NIF started itself.
+ *
+ * Mailboxes are intrusive MPSC queues in the manner of Vyukov's: a
+ * sender swaps its message in as the tail and then links the old tail
+ * to it, so sending never takes a lock, and only the owner takes
+ * messages off the head.  A receiver with nothing to do sleeps, saying
+ * so first, and senders look for sleepers after linking their message
+ * in, so one of them always sees the other.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "erl_nif.h"
+#include "macrology.h"
+#include "process.h"
+
+struct message {
+    struct message *next;
+    ErlNifEnv *env;
+    term msg;
+};
+
+struct process {
+    unsigned id;
+    bool alive_p;
+    /* The owner's end, and the senders'.  The stub keeps the queue
+     * from ever being empty, which is what lets the two ends work
+     * without a lock. */
+    struct message *head __attribute__((aligned(64)));
+    struct message *tail __attribute__((aligned(64)));
+    struct message stub;
+    unsigned waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+};
+
+static struct process **processes;
+static unsigned n_processes;
+static pthread_mutex_t processes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct process *main_process;
+
+
+/* Pids count from 1, so <0.0.0> is never a live process. */
+struct process *process_spawn(void)
+{
+    struct process *p = calloc(1, sizeof(*p));
+    if (NULL == p)
+        return NULL;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->arrived, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&p->lock, NULL);
+    p->head = p->tail = &p->stub;
+    p->alive_p = true;
+
+    pthread_mutex_lock(&processes_lock);
+    struct process **more = realloc(processes, (n_processes+1) * sizeof(*more));
+    if (more) {
+        processes = more;
+        processes[n_processes++] = p;
+        p->id = n_processes;
+    }
+    pthread_mutex_unlock(&processes_lock);
+    if (NULL == more) {
+        pthread_cond_destroy(&p->arrived);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+
+/* The script's process, which is also the one benchmarks and parallel
+ * replays run in. */
+struct process *process_main(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    void spawn_main(void) {
+        if (NULL == (main_process = process_spawn()))
+            abort();
+    }
+    pthread_once(&once, spawn_main);
+    return main_process;
+}
+
+
+static struct process *find_process(term pid)
+{
+    if (!enif_is_pid(NULL, pid))
+        return NULL;
+    unsigned id = pid_untagged(pid);
+    pthread_mutex_lock(&processes_lock);
+    struct process *p = id > 0 && id <= n_processes ? processes[id-1] : NULL;
+    pthread_mutex_unlock(&processes_lock);
+    return p;
+}
+
+
+static void push(struct process *p, struct message *m)
+{
+    __atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+    struct message *prev = __atomic_exchange_n(&p->tail, m, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, m, __ATOMIC_SEQ_CST);
+}
+
+
+/* Owner only.  NULL if the mailbox is empty, or if a sender is half
+ * way through linking in a message, in which case it'll wake us. */
+static struct message *pop(struct process *p)
+{
+    struct message *head = p->head,
+        *next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+    if (&p->stub == head) {
+        if (NULL == next)
+            return NULL;
+        p->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+    }
+    if (next) {
+        p->head = next;
+        return head;
+    }
+    if (head != __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST))
+        return NULL;
+    push(p, &p->stub);
+    if (NULL != (next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST))) {
+        p->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+
+static void free_message(struct message *m)
+{
+    enif_free_env(m->env);
+    free(m);
+}
+
+
+/* Owner only: drops every message in p's mailbox. */
+void process_drain(struct process *p)
+{
+    for (struct message *m; NULL != (m = pop(p));)
+        free_message(m);
+}
+
+
+/* Messages already on their way are dropped with the rest. */
+void process_exit(struct process *p)
+{
+    __atomic_store_n(&p->alive_p, false, __ATOMIC_SEQ_CST);
+    process_drain(p);
+}
+
+
+ErlNifPid *enif_self(ErlNifEnv *env, ErlNifPid *pid)
+{
+    if (NULL == env || NULL == env->process)
+        return NULL;
+    pid->pid = make_pid(env->process->id);
+    return pid;
+}
+
+
+/* As in ERTS, msg_env (if any) is cleared by sending, so the NIF can't
+ * go on using what it sent. */
+int enif_send(ErlNifEnv *UNUSED, const ErlNifPid *to, ErlNifEnv *msg_env, term msg)
+{
+    struct process *p = find_process(to->pid);
+    int sent = 0;
+    if (p && __atomic_load_n(&p->alive_p, __ATOMIC_SEQ_CST)) {
+        struct message *m = malloc(sizeof(*m));
+        if (m && NULL == (m->env = enif_alloc_env())) {
+            free(m);
+            m = NULL;
+        }
+        if (m) {
+            m->msg = enif_make_copy(m->env, msg);
+            push(p, m);
+            if (__atomic_load_n(&p->waiting, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&p->lock);
+                pthread_cond_broadcast(&p->arrived);
+                pthread_mutex_unlock(&p->lock);
+            }
+            sent = 1;
+        }
+    }
+    if (msg_env)
+        enif_clear_env(msg_env);
+    return sent;
+}
+
+
+/* Takes the oldest message in env's process's mailbox, copying it into
+ * env, waiting at most timeout_ms for one to arrive (or for ever, if
+ * it's negative).  False if none did. */
+bool process_receive(ErlNifEnv *env, long timeout_ms, term *msg)
+{
+    struct process *p = env->process;
+    if (NULL == p)
+        return false;
+    struct message *m = pop(p);
+    if (NULL == m && 0 != timeout_ms) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&p->lock);
+        __atomic_store_n(&p->waiting, 1, __ATOMIC_SEQ_CST);
+        int err = 0;
+        while (NULL == (m = pop(p)) && ETIMEDOUT != err)
+            err = timeout_ms < 0 ? pthread_cond_wait(&p->arrived, &p->lock) :
+                pthread_cond_timedwait(&p->arrived, &p->lock, &deadline);
+        __atomic_store_n(&p->waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (NULL == m)
+        return false;
+    *msg = enif_make_copy(env, m->msg);
+    free_message(m);
+    return true;
+}
+
+
+/* Messages can hold resources, whose destructors live in the NIFs, so
+ * this must come before unloading them. */
+void process_destroy_all(void)
+{
+    pthread_mutex_lock(&processes_lock);
+    for (unsigned i = 0; i < n_processes; ++i) {
+        struct process *p = processes[i];
+        process_drain(p);
+        pthread_cond_destroy(&p->arrived);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+    }
+    free(processes);
+    processes = NULL;
+    n_processes = 0;
+    main_process = NULL;
+    pthread_mutex_unlock(&processes_lock);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "nif_stubs.h"
+
+struct process;
+
+extern struct process *process_main(void);
+extern struct process *process_spawn(void);
+extern void process_exit(struct process *);
+extern void process_drain(struct process *);
+extern bool process_receive(ErlNifEnv *, long, term *);
+extern void process_destroy_all(void);
@@ -0,0 +1,771 @@
+/* Compiled scripts
+ *
+ * Lexing, parsing and looking up functions cost far more than most NIF
+ * calls, so a script that will be run many times (benchmarks, fuzzing)
+ * is compiled once into a flat array of instructions.  Arguments are
+ * built ahead of time in the program's own env, functions are resolved
+ * to their fptrs, and variables become numbered slots.
+ *
+ * Each run starts from the bindings in variable.c and leaves them
+ * alone; what a run binds is dropped at the end of it.
+ *
+ * A program can also be run as a benchmark, where each call is timed
+ * over many iterations and reported instead of printed, or run on
+ * several threads at once as a stress test.  Each thread has its own
+ * env and bindings, as each Erlang process calling the NIF would, and
+ * shares the NIF's priv_data with the others.
+ *
+ * Or it can be replayed on a pool of workers, running statements as
+ * soon as the statements they depend on are done: those that bound
+ * the variables they use, and, before rebinding a variable, those
+ * that used its old value.  Calls to niffy's own functions (such as
+ * load_nif) wait for everything before them, and everything after
+ * waits for them.  Output is still printed in program order.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "histogram.h"
+#include "lex.h"
+#include "macrology.h"
+#include "map.h"
+#include "niffy.h"
+#include "parse_protos.h"
+#include "process.h"
+#include "program.h"
+#include "variable.h"
+
+enum opcode { OP_CALL, OP_CALL_BIND, OP_CALL_PRINT, OP_BIND, OP_PRINT };
+
+/* How an argument is turned into a term at run time: used as is,
+ * fetched from a slot, or copied with its variables filled in. */
+enum argument { ARG_CONSTANT, ARG_SLOT, ARG_TEMPLATE };
+
+struct instruction {
+    enum opcode op;
+    unsigned slot;
+    struct fptr *f;
+    unsigned argc;
+    term *argv;
+    unsigned char *kinds;
+    /* The slots the arguments refer to, for parallel replay. */
+    unsigned n_reads;
+    unsigned *reads;
+    bool barrier_p;
+};
+
+/* What running a program changes.  Slots point into bindings; spare
+ * is where they're copied when rebinding has left enough garbage
+ * behind.  A run with an env of its own calls NIFs in that, and clears
+ * it after each statement; otherwise it's niffy's call env. */
+struct run {
+    term *slots, *argv;
+    ErlNifEnv *bindings, *spare, *env;
+    size_t live_after_gc;
+    unsigned long calls;
+    struct histogram *latency;
+};
+
+struct program {
+    struct instruction *code;
+    size_t len, avail;
+    ErlNifEnv *constants;
+    atom *names;
+    unsigned n_slots, max_argc;
+    struct run run;
+    unsigned long bench_iterations;
+};
+
+/* Only set while Parse is calling back into compile_statement. */
+static struct program *compiling;
+static struct atom_ptr_map slot_of_name;
+static bool compile_failed_p;
+static unsigned *reads, n_reads, reads_avail;
+
+
+static unsigned slot_of(atom name)
+{
+    uintptr_t slot = (uintptr_t)map_lookup(&slot_of_name, name);
+    if (slot)
+        return slot-1;
+    struct program *p = compiling;
+    atom *names = realloc(p->names, (p->n_slots+1) * sizeof(*names));
+    if (NULL == names || !map_insert(&slot_of_name, name, (void *)(uintptr_t)(p->n_slots+1))) {
+        compile_failed_p = true;
+        return 0;
+    }
+    p->names = names;
+    p->names[p->n_slots] = name;
+    return p->n_slots++;
+}
+
+
+static term slot_variable(void *UNUSED, term v)
+{
+    unsigned slot = slot_of(variable_untagged(v));
+    if (n_reads == reads_avail) {
+        unsigned avail = reads_avail ? 2*reads_avail : 8;
+        unsigned *more = realloc(reads, avail * sizeof(*reads));
+        if (NULL == more) {
+            compile_failed_p = true;
+            return tagged_variable(slot);
+        }
+        reads = more;
+        reads_avail = avail;
+    }
+    reads[n_reads++] = slot;
+    return tagged_variable(slot);
+}
+
+
+static struct instruction *emit(enum opcode op)
+{
+    struct program *p = compiling;
+    if (p->len == p->avail) {
+        size_t avail = p->avail ? 2*p->avail : 16;
+        struct instruction *code = realloc(p->code, avail * sizeof(*code));
+        if (NULL == code) {
+            compile_failed_p = true;
+            return NULL;
+        }
+        p->code = code;
+        p->avail = avail;
+    }
+    struct instruction *in = &p->code[p->len++];
+    *in = (struct instruction){.op = op};
+    return in;
+}
+
+
+static bool compile_arguments(struct instruction *in, term args)
+{
+    ErlNifEnv *env = compiling->constants;
+    unsigned argc;
+    if (!enif_get_list_length(NULL, args, &argc))
+        return false;
+    in->argc = argc;
+    in->argv = arena_alloc(&env->heap, (argc ? argc : 1) * sizeof(*in->argv));
+    in->kinds = arena_alloc(&env->heap, argc ? argc : 1);
+    if (NULL == in->argv || NULL == in->kinds)
+        return false;
+    term head;
+    n_reads = 0;
+    for (unsigned i = 0; enif_get_list_cell(NULL, args, &head, &args); ++i) {
+        in->argv[i] = copy_substituting_variables(env, head, slot_variable, NULL);
+        if (TERM_VARIABLE == type_of_term(in->argv[i]))
+            in->kinds[i] = ARG_SLOT;
+        else if (contains_variables(in->argv[i]))
+            in->kinds[i] = ARG_TEMPLATE;
+        else
+            in->kinds[i] = ARG_CONSTANT;
+    }
+    if (n_reads) {
+        if (NULL == (in->reads = arena_alloc(&env->heap, n_reads * sizeof(*in->reads))))
+            return false;
+        memcpy(in->reads, reads, n_reads * sizeof(*in->reads));
+        in->n_reads = n_reads;
+    }
+    if (argc > compiling->max_argc)
+        compiling->max_argc = argc;
+    return true;
+}
+
+
+static void compile_statement(struct statement *st)
+{
+    static atom underscore, niffy;
+    if (!underscore) {
+        underscore = intern_cstr("_");
+        niffy = intern_cstr("niffy");
+    }
+    bool discard_p = st->variable == underscore;
+    struct instruction *in = NULL;
+
+    switch (st->type) {
+    default:
+    case AST_ST_NOP:
+        break;
+
+    case AST_ST_V_OF_TERM:
+        if (discard_p)
+            break;
+        if (NULL == (in = emit(OP_BIND)))
+            break;
+        in->slot = slot_of(st->variable);
+        compile_failed_p |= !compile_arguments(in, st->call.args);
+        break;
+
+    case AST_ST_V_OF_MFA:
+    case AST_ST_MFA:
+        if (NULL == (in = emit(AST_ST_MFA == st->type ? OP_CALL_PRINT :
+                               discard_p ? OP_CALL : OP_CALL_BIND)))
+            break;
+        if (OP_CALL_BIND == in->op)
+            in->slot = slot_of(st->variable);
+        if (!compile_arguments(in, st->call.args)) {
+            compile_failed_p = true;
+            break;
+        }
+        in->f = niffy_resolve(st->call.module, st->call.function, in->argc);
+        in->barrier_p = niffy == st->call.module;
+        break;
+
+    case AST_ST_VAR:
+        if (NULL != (in = emit(OP_PRINT)))
+            in->slot = slot_of(st->variable);
+        break;
+    }
+
+    enif_clear_env(NULL);
+}
+
+
+static bool run_init(struct program *p, struct run *r, bool own_env_p)
+{
+    *r = (struct run){0};
+    r->slots = calloc(p->n_slots ? p->n_slots : 1, sizeof(*r->slots));
+    r->argv = calloc(p->max_argc ? p->max_argc : 1, sizeof(*r->argv));
+    r->bindings = enif_alloc_env();
+    r->spare = enif_alloc_env();
+    if (own_env_p && NULL != (r->env = enif_alloc_env()))
+        r->env->process = process_spawn();
+    return r->slots && r->argv && r->bindings && r->spare &&
+        (!own_env_p || (r->env && r->env->process));
+}
+
+
+static void run_free(struct run *r)
+{
+    if (r->bindings)
+        enif_free_env(r->bindings);
+    if (r->spare)
+        enif_free_env(r->spare);
+    if (r->env) {
+        if (r->env->process)
+            process_exit(r->env->process);
+        enif_free_env(r->env);
+    }
+    free(r->slots);
+    free(r->argv);
+    free(r->latency);
+}
+
+
+struct program *program_compile(char *text, size_t len)
+{
+    struct program *p = calloc(1, sizeof(*p));
+    if (NULL == p)
+        return NULL;
+    if (NULL == (p->constants = enif_alloc_env())) {
+        program_free(p);
+        return NULL;
+    }
+
+    compiling = p;
+    compile_failed_p = false;
+    void *parser = ParseAlloc(malloc);
+    struct lexer lexer;
+    lex_init(&lexer);
+    lex_setup_next_line(&lexer, text, len, true);
+    struct token token;
+    while (lex(&lexer, &token))
+        Parse(parser, token.type, token, compile_statement);
+    Parse(parser, 0, (struct token){.type = 0, .location = lexer.location},
+          compile_statement);
+    ParseFree(parser, free);
+    map_destroy(&slot_of_name);
+    free(reads);
+    reads = NULL;
+    n_reads = reads_avail = 0;
+    compiling = NULL;
+
+    if (compile_failed_p || !run_init(p, &p->run, false)) {
+        program_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+
+static term slot_value(void *data, term v)
+{
+    struct run *r = data;
+    return r->slots[variable_untagged(v)];
+}
+
+
+static void bind(struct run *r, unsigned slot, term v)
+{
+    r->slots[slot] = v ? enif_make_copy(r->bindings, v) : v;
+}
+
+
+/* Same policy as variable_gc: once the bindings have grown to twice
+ * what survived last time, copy the live ones across. */
+static void gc(struct program *p, struct run *r)
+{
+    if (!variable_gc_due_p(arena_used(&r->bindings->heap), r->live_after_gc))
+        return;
+    ErlNifEnv *from = r->bindings;
+    r->bindings = r->spare;
+    for (unsigned i = 0; i < p->n_slots; ++i)
+        bind(r, i, r->slots[i]);
+    enif_clear_env(from);
+    r->spare = from;
+    r->live_after_gc = arena_used(&r->bindings->heap);
+}
+
+
+static term argument(struct run *r, const struct instruction *in, unsigned i)
+{
+    switch (in->kinds[i]) {
+    case ARG_SLOT:
+        return slot_value(r, in->argv[i]);
+    case ARG_TEMPLATE:
+        return substitute_variables(r->env, in->argv[i], slot_value, r);
+    default:
+        return in->argv[i];
+    }
+}
+
+
+/* Runs with their own env are stress tests: they time their calls
+ * rather than print anything. */
+static void run(struct program *p, struct run *r)
+{
+    bool quiet_p = p->bench_iterations || r->env;
+
+    for (unsigned i = 0; i < p->n_slots; ++i)
+        bind(r, i, variable_lookup(p->names[i]));
+
+    for (size_t pc = 0; pc < p->len; ++pc) {
+        const struct instruction *in = &p->code[pc];
+        term result;
+
+        switch (in->op) {
+        case OP_BIND:
+            bind(r, in->slot, argument(r, in, 0));
+            break;
+
+        case OP_PRINT:
+            if (quiet_p)
+                break;
+            pretty_print_term(stdout, &r->slots[in->slot]);
+            putchar('\n');
+            break;
+
+        default:
+            for (unsigned i = 0; i < in->argc; ++i)
+                r->argv[i] = argument(r, in, i);
+            if (p->bench_iterations) {
+                struct bench_stats stats;
+                if (!bench(in->f, in->argc, r->argv, p->bench_iterations,
+                           NULL, &result, &stats))
+                    abort();
+                bench_print(stdout, in->f, &stats);
+            } else if (r->env) {
+                uint64_t start = monotonic_ns();
+                result = niffy_invoke_in(r->env, in->f, in->argc, r->argv);
+                if (!histogram_record(&r->latency, monotonic_ns() - start))
+                    abort();
+            } else
+                result = niffy_invoke(in->f, in->argc, r->argv);
+            ++r->calls;
+            if (OP_CALL_BIND == in->op)
+                bind(r, in->slot, result);
+            else if (OP_CALL_PRINT == in->op && !quiet_p) {
+                pretty_print_term(stdout, &result);
+                putchar('\n');
+            }
+            break;
+        }
+
+        if (r->env)
+            enif_clear_env(r->env);
+        else
+            niffy_end_statement();
+        gc(p, r);
+    }
+
+    enif_clear_env(r->bindings);
+    r->live_after_gc = 0;
+}
+
+
+void program_run(struct program *p)
+{
+    run(p, &p->run);
+}
+
+
+/* From now on, each call is benchmarked over n iterations (or run
+ * normally, if n is 0). */
+void program_bench(struct program *p, unsigned long n)
+{
+    p->bench_iterations = n;
+}
+
+
+struct stress_thread {
+    struct program *program;
+    struct run run;
+    unsigned long repeat;
+    pthread_barrier_t *start;
+    uint64_t elapsed;
+    pthread_t thread;
+};
+
+
+static void *stress_thread(void *arg)
+{
+    struct stress_thread *t = arg;
+    pthread_barrier_wait(t->start);
+    uint64_t start = monotonic_ns();
+    for (unsigned long i = 0; i < t->repeat; ++i)
+        run(t->program, &t->run);
+    t->elapsed = monotonic_ns() - start;
+    return NULL;
+}
+
+
+/* Runs the program repeat times over on each of n_threads threads, all
+ * started together, then prints each thread's call rate and latency
+ * and the rate of all of them together. */
+bool program_stress(struct program *p, unsigned n_threads, unsigned long repeat)
+{
+    struct stress_thread *threads = calloc(n_threads, sizeof(*threads));
+    pthread_barrier_t start;
+    if (NULL == threads || 0 != pthread_barrier_init(&start, NULL, n_threads + 1)) {
+        free(threads);
+        return false;
+    }
+
+    bool ok = true;
+    for (unsigned i = 0; i < n_threads; ++i) {
+        threads[i] = (struct stress_thread){.program = p, .repeat = repeat, .start = &start};
+        ok = run_init(p, &threads[i].run, true) && ok;
+    }
+    for (unsigned i = 0; ok && i < n_threads; ++i) {
+        if (0 != pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i])) {
+            fprintf(stderr, "couldn't start stress thread\n");
+            abort();
+        }
+    }
+
+    uint64_t wall = 0;
+    if (ok) {
+        pthread_barrier_wait(&start);
+        wall = monotonic_ns();
+        for (unsigned i = 0; i < n_threads; ++i)
+            pthread_join(threads[i].thread, NULL);
+        wall = monotonic_ns() - wall;
+    }
+    pthread_barrier_destroy(&start);
+
+    if (ok) {
+        unsigned long calls = 0;
+        printf("%-8s %12s %14s %10s %10s %10s\n",
+               "thread", "calls", "calls/sec", "p50 ns", "p99 ns", "max ns");
+        for (unsigned i = 0; i < n_threads; ++i) {
+            const struct run *r = &threads[i].run;
+            uint64_t elapsed = threads[i].elapsed ? threads[i].elapsed : 1;
+            calls += r->calls;
+            printf("%-8u %12lu %14.0f", i, r->calls, r->calls * 1e9 / elapsed);
+            if (r->latency)
+                printf(" %10llu %10llu %10llu\n",
+                       (unsigned long long)histogram_percentile(r->latency, 50),
+                       (unsigned long long)histogram_percentile(r->latency, 99),
+                       (unsigned long long)r->latency->max);
+            else
+                printf(" %10s %10s %10s\n", "-", "-", "-");
+        }
+        printf("%-8s %12lu %14.0f\n", "all", calls, calls * 1e9 / (wall ? wall : 1));
+    }
+    for (unsigned i = 0; i < n_threads; ++i)
+        run_free(&threads[i].run);
+    free(threads);
+    return ok;
+}
+
+
+enum { NO_INSTRUCTION = SIZE_MAX };
+
+struct node {
+    unsigned waiting;
+    size_t *next, n_next, next_avail;
+    bool done_p;
+    char *output;
+    size_t output_len;
+};
+
+struct replay {
+    struct program *program;
+    struct node *nodes;
+    /* Each bound value has an env of its own.  Rebinding copies into
+     * the slot's spare and clears the old one, which becomes the
+     * spare, so envs are reused rather than made afresh. */
+    term *slots;
+    struct slot_envs {
+        ErlNifEnv *live, *spare;
+    } *slot_envs;
+    /* Every node is queued exactly once, so this needn't wrap. */
+    size_t *ready, n_ready, n_taken;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+
+static bool add_edge(struct replay *rp, size_t from, size_t to)
+{
+    if (from == NO_INSTRUCTION || from == to)
+        return true;
+    struct node *n = &rp->nodes[from];
+    if (n->n_next == n->next_avail) {
+        size_t avail = n->next_avail ? 2*n->next_avail : 4;
+        size_t *next = realloc(n->next, avail * sizeof(*next));
+        if (NULL == next)
+            return false;
+        n->next = next;
+        n->next_avail = avail;
+    }
+    n->next[n->n_next++] = to;
+    ++rp->nodes[to].waiting;
+    return true;
+}
+
+
+static bool add_dependencies(struct replay *rp)
+{
+    struct program *p = rp->program;
+    unsigned n = p->n_slots ? p->n_slots : 1;
+    size_t *last_writer = malloc(n * sizeof(*last_writer));
+    struct readers {
+        size_t *pcs, len, avail;
+    } *readers = calloc(n, sizeof(*readers));
+    size_t last_barrier = NO_INSTRUCTION;
+    bool ok = last_writer && readers;
+
+    bool read(size_t pc, unsigned slot) {
+        struct readers *r = &readers[slot];
+        if (r->len == r->avail) {
+            size_t avail = r->avail ? 2*r->avail : 4;
+            size_t *pcs = realloc(r->pcs, avail * sizeof(*pcs));
+            if (NULL == pcs)
+                return false;
+            r->pcs = pcs;
+            r->avail = avail;
+        }
+        r->pcs[r->len++] = pc;
+        return add_edge(rp, last_writer[slot], pc);
+    }
+    bool write(size_t pc, unsigned slot) {
+        struct readers *r = &readers[slot];
+        bool ok = add_edge(rp, last_writer[slot], pc);
+        for (size_t i = 0; i < r->len; ++i)
+            ok = ok && add_edge(rp, r->pcs[i], pc);
+        r->len = 0;
+        last_writer[slot] = pc;
+        return ok;
+    }
+
+    for (unsigned i = 0; ok && i < n; ++i)
+        last_writer[i] = NO_INSTRUCTION;
+    for (size_t pc = 0; ok && pc < p->len; ++pc) {
+        const struct instruction *in = &p->code[pc];
+        if (in->barrier_p) {
+            size_t from = NO_INSTRUCTION == last_barrier ? 0 : last_barrier;
+            for (; ok && from < pc; ++from)
+                ok = add_edge(rp, from, pc);
+            last_barrier = pc;
+        } else
+            ok = add_edge(rp, last_barrier, pc);
+        for (unsigned i = 0; ok && i < in->n_reads; ++i)
+            ok = read(pc, in->reads[i]);
+        if (ok && OP_PRINT == in->op)
+            ok = read(pc, in->slot);
+        if (ok && (OP_BIND == in->op || OP_CALL_BIND == in->op))
+            ok = write(pc, in->slot);
+    }
+
+    for (unsigned i = 0; readers && i < n; ++i)
+        free(readers[i].pcs);
+    free(readers);
+    free(last_writer);
+    return ok;
+}
+
+
+static void replay_bind(struct replay *rp, unsigned slot, term v)
+{
+    struct slot_envs *e = &rp->slot_envs[slot];
+    ErlNifEnv *env = e->spare;
+    if (NULL == env && NULL == (env = enif_alloc_env()))
+        abort();
+    rp->slots[slot] = v ? enif_make_copy(env, v) : v;
+    e->spare = e->live;
+    e->live = env;
+    if (e->spare)
+        enif_clear_env(e->spare);
+}
+
+
+static void replay_execute(struct replay *rp, struct run *r, size_t pc)
+{
+    const struct instruction *in = &rp->program->code[pc];
+    struct node *node = &rp->nodes[pc];
+    FILE *out = NULL;
+    term result;
+
+    if (OP_PRINT == in->op || OP_CALL_PRINT == in->op)
+        if (NULL == (out = open_memstream(&node->output, &node->output_len)))
+            abort();
+
+    switch (in->op) {
+    case OP_BIND:
+        replay_bind(rp, in->slot, argument(r, in, 0));
+        break;
+
+    case OP_PRINT:
+        pretty_print_term(out, &rp->slots[in->slot]);
+        fputc('\n', out);
+        break;
+
+    default:
+        for (unsigned i = 0; i < in->argc; ++i)
+            r->argv[i] = argument(r, in, i);
+        result = niffy_invoke_in(r->env, in->f, in->argc, r->argv);
+        if (OP_CALL_BIND == in->op)
+            replay_bind(rp, in->slot, result);
+        else if (OP_CALL_PRINT == in->op) {
+            pretty_print_term(out, &result);
+            fputc('\n', out);
+        }
+        break;
+    }
+
+    if (out)
+        fclose(out);
+    enif_clear_env(r->env);
+}
+
+
+static void *replay_worker(void *arg)
+{
+    struct replay *rp = arg;
+    struct program *p = rp->program;
+    struct run r = {
+        .slots = rp->slots,
+        .argv = calloc(p->max_argc ? p->max_argc : 1, sizeof(*r.argv)),
+        .env = enif_alloc_env()
+    };
+    if (NULL == r.argv || NULL == r.env)
+        abort();
+    r.env->process = process_main();
+
+    pthread_mutex_lock(&rp->lock);
+    for (;;) {
+        while (rp->n_taken == rp->n_ready && rp->n_taken < p->len)
+            pthread_cond_wait(&rp->work, &rp->lock);
+        if (rp->n_taken == p->len)
+            break;
+        size_t pc = rp->ready[rp->n_taken++];
+        pthread_mutex_unlock(&rp->lock);
+
+        replay_execute(rp, &r, pc);
+
+        pthread_mutex_lock(&rp->lock);
+        struct node *node = &rp->nodes[pc];
+        for (size_t i = 0; i < node->n_next; ++i)
+            if (0 == --rp->nodes[node->next[i]].waiting)
+                rp->ready[rp->n_ready++] = node->next[i];
+        node->done_p = true;
+        pthread_cond_broadcast(&rp->work);
+        pthread_cond_broadcast(&rp->done);
+    }
+    pthread_mutex_unlock(&rp->lock);
+
+    free(r.argv);
+    enif_free_env(r.env);
+    return NULL;
+}
+
+
+/* Runs the program on n_workers threads, each with its own call env,
+ * printing each statement's output once everything before it has
+ * printed. */
+bool program_replay(struct program *p, unsigned n_workers)
+{
+    struct replay rp = {
+        .program = p,
+        .nodes = calloc(p->len ? p->len : 1, sizeof(*rp.nodes)),
+        .slots = calloc(p->n_slots ? p->n_slots : 1, sizeof(*rp.slots)),
+        .slot_envs = calloc(p->n_slots ? p->n_slots : 1, sizeof(*rp.slot_envs)),
+        .ready = calloc(p->len ? p->len : 1, sizeof(*rp.ready)),
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .work = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER
+    };
+    pthread_t *workers = calloc(n_workers, sizeof(*workers));
+    bool ok = rp.nodes && rp.slots && rp.slot_envs && rp.ready && workers &&
+        add_dependencies(&rp);
+
+    if (ok) {
+        for (unsigned i = 0; i < p->n_slots; ++i)
+            replay_bind(&rp, i, variable_lookup(p->names[i]));
+        for (size_t pc = 0; pc < p->len; ++pc)
+            if (0 == rp.nodes[pc].waiting)
+                rp.ready[rp.n_ready++] = pc;
+        for (unsigned i = 0; i < n_workers; ++i) {
+            if (0 != pthread_create(&workers[i], NULL, replay_worker, &rp)) {
+                fprintf(stderr, "couldn't start replay worker\n");
+                abort();
+            }
+        }
+
+        pthread_mutex_lock(&rp.lock);
+        for (size_t pc = 0; pc < p->len; ++pc) {
+            struct node *node = &rp.nodes[pc];
+            while (!node->done_p)
+                pthread_cond_wait(&rp.done, &rp.lock);
+            if (node->output)
+                fwrite(node->output, 1, node->output_len, stdout);
+            free(node->output);
+            node->output = NULL;
+        }
+        pthread_mutex_unlock(&rp.lock);
+        for (unsigned i = 0; i < n_workers; ++i)
+            pthread_join(workers[i], NULL);
+    }
+
+    for (size_t pc = 0; rp.nodes && pc < p->len; ++pc)
+        free(rp.nodes[pc].next);
+    for (unsigned i = 0; rp.slot_envs && i < p->n_slots; ++i) {
+        if (rp.slot_envs[i].live)
+            enif_free_env(rp.slot_envs[i].live);
+        if (rp.slot_envs[i].spare)
+            enif_free_env(rp.slot_envs[i].spare);
+    }
+    free(rp.nodes);
+    free(rp.slots);
+    free(rp.slot_envs);
+    free(rp.ready);
+    free(workers);
+    return ok;
+}
+
+
+void program_free(struct program *p)
+{
+    if (p->constants)
+        enif_free_env(p->constants);
+    run_free(&p->run);
+    free(p->code);
+    free(p->names);
+    free(p);
+}
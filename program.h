@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct program;
+
+extern struct program *program_compile(char *, size_t);
+extern void program_run(struct program *);
+extern void program_bench(struct program *, unsigned long);
+extern bool program_stress(struct program *, unsigned, unsigned long);
+extern bool program_replay(struct program *, unsigned);
+extern void program_free(struct program *);
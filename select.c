@@ -0,0 +1,344 @@
+/* enif_select
+ *
+ * A poller thread waits on an epoll set for the descriptors NIFs have
+ * selected, and when one is ready sends
+ *
+ *     {select, Obj, Ref, ready_input | ready_output}
+ *
+ * to the process that asked, as ERTS does.  Each direction is one
+ * shot: once its message is sent, the NIF must select it again to get
+ * another.  Registering keeps a reference to the resource until the
+ * descriptor is stopped.
+ *
+ * epoll won't take regular files, which are always ready anyway, so
+ * for those the message is sent straight away.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "erl_nif.h"
+#include "macrology.h"
+#include "select.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+enum { INPUT, OUTPUT, N_DIRECTIONS };
+
+/* What a process asked to be told about one direction of an fd. */
+struct interest {
+    bool armed_p;
+    ErlNifPid pid;
+    term ref;
+};
+
+struct selected {
+    int fd;
+    /* Tells this registration of fd from earlier ones, whose events
+     * may still be on their way to the poller. */
+    uint32_t generation;
+    void *obj;
+    /* Holds the refs. */
+    ErlNifEnv *env;
+    struct interest interests[N_DIRECTIONS];
+};
+
+static const uint32_t epoll_event_of[N_DIRECTIONS] = {EPOLLIN, EPOLLOUT};
+static const char *const message_of[N_DIRECTIONS] = {"ready_input", "ready_output"};
+
+static int epoll_fd = -1, wakeup_fd = -1;
+static pthread_t poller;
+static bool poller_started_p, stopping_p;
+/* Indexed by fd.  The lock covers these and everything they point to.
+ * epoll events carry the fd and generation rather than a pointer, as
+ * the entry may be gone by the time the poller gets the lock. */
+static struct selected **by_fd;
+static int by_fd_len;
+static uint32_t last_generation;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void send_ready(struct selected *s, int direction)
+{
+    struct interest *in = &s->interests[direction];
+    ErlNifEnv *msg_env = enif_alloc_env();
+    if (NULL == msg_env)
+        abort();
+    term msg = enif_make_tuple(msg_env, 4, enif_make_atom(msg_env, "select"),
+                               enif_make_resource(msg_env, s->obj),
+                               enif_make_copy(msg_env, in->ref),
+                               enif_make_atom(msg_env, message_of[direction]));
+    enif_send(NULL, &in->pid, msg_env, msg);
+    enif_free_env(msg_env);
+    in->armed_p = false;
+}
+
+
+static uint32_t armed_events(const struct selected *s)
+{
+    uint32_t events = 0;
+    for (int d = 0; d < N_DIRECTIONS; ++d)
+        if (s->interests[d].armed_p)
+            events |= epoll_event_of[d];
+    return events;
+}
+
+
+/* Every registered fd is one-shot in epoll too, and re-armed with
+ * whatever's still wanted after each wakeup. */
+static uint64_t event_data(const struct selected *s)
+{
+    return (uint64_t)s->generation << 32 | (uint32_t)s->fd;
+}
+
+
+static struct selected *selected_of_event_data(uint64_t data)
+{
+    int fd = (uint32_t)data;
+    struct selected *s = fd < by_fd_len ? by_fd[fd] : NULL;
+    return s && s->generation == data >> 32 ? s : NULL;
+}
+
+
+static void rearm(struct selected *s)
+{
+    struct epoll_event ev = {.events = armed_events(s) | EPOLLONESHOT, .data.u64 = event_data(s)};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+
+static void *poll_loop(void *UNUSED)
+{
+    enum { MAX_EVENTS = 64 };
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && EINTR != errno)
+            abort();
+        pthread_mutex_lock(&lock);
+        if (stopping_p) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+            /* The wakeup fd, or one that's since been stopped. */
+            struct selected *s = selected_of_event_data(events[i].data.u64);
+            if (NULL == s)
+                continue;
+            /* Errors and hangups wake everyone, so they can find out
+             * what happened by trying. */
+            uint32_t ready = events[i].events;
+            if (ready & (EPOLLERR | EPOLLHUP))
+                ready |= EPOLLIN | EPOLLOUT;
+            for (int d = 0; d < N_DIRECTIONS; ++d)
+                if (s->interests[d].armed_p && (ready & epoll_event_of[d]))
+                    send_ready(s, d);
+            if (armed_events(s))
+                rearm(s);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+
+static bool start_poller(void)
+{
+    if (poller_started_p)
+        return true;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return false;
+    if ((wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+        return false;
+    }
+    /* Generation 0, which no registration has. */
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (uint32_t)wakeup_fd};
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) ||
+        0 != pthread_create(&poller, NULL, poll_loop, NULL)) {
+        close(wakeup_fd);
+        close(epoll_fd);
+        wakeup_fd = epoll_fd = -1;
+        return false;
+    }
+    poller_started_p = true;
+    return true;
+}
+
+
+/* Returns the resource whose reference the registration held, for the
+ * caller to release once it's let go of the lock: the release may run
+ * the resource's destructor, which may well select again. */
+static void *forget(struct selected *s)
+{
+    void *obj = s->obj;
+    by_fd[s->fd] = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    enif_free_env(s->env);
+    free(s);
+    return obj;
+}
+
+
+/* Finds or makes fd's entry, registering it with epoll in the process.
+ * With *always_ready_p set (and no entry) if it's a regular file. */
+static struct selected *selected_for(int fd, void *obj, bool *always_ready_p)
+{
+    *always_ready_p = false;
+    if (fd < by_fd_len && by_fd[fd])
+        return by_fd[fd];
+    if (fd >= by_fd_len) {
+        int len = by_fd_len ? by_fd_len : 64;
+        while (len <= fd)
+            len *= 2;
+        struct selected **more = realloc(by_fd, len * sizeof(*more));
+        if (NULL == more)
+            return NULL;
+        for (int i = by_fd_len; i < len; ++i)
+            more[i] = NULL;
+        by_fd = more;
+        by_fd_len = len;
+    }
+
+    struct selected *s = calloc(1, sizeof(*s));
+    if (NULL == s || NULL == (s->env = enif_alloc_env())) {
+        free(s);
+        return NULL;
+    }
+    s->fd = fd;
+    if (0 == ++last_generation)
+        ++last_generation;
+    s->generation = last_generation;
+    s->obj = obj;
+    struct epoll_event ev = {.events = EPOLLONESHOT, .data.u64 = event_data(s)};
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        *always_ready_p = EPERM == errno;
+        enif_free_env(s->env);
+        free(s);
+        return NULL;
+    }
+    enif_keep_resource(obj);
+    return by_fd[fd] = s;
+}
+
+
+static int stop(ErlNifEnv *env, int fd, void *obj)
+{
+    void *registered = NULL;
+    pthread_mutex_lock(&lock);
+    if (fd < by_fd_len && by_fd[fd])
+        registered = forget(by_fd[fd]);
+    pthread_mutex_unlock(&lock);
+    /* Nothing of ours refers to the fd any more, so the NIF can close
+     * it straight away.  The registration's reference keeps obj alive
+     * until its stop callback has run. */
+    int result = resource_stop(env, obj, fd, true) ? ERL_NIF_SELECT_STOP_CALLED : 0;
+    if (registered)
+        enif_release_resource(registered);
+    return result;
+}
+
+
+int enif_select(ErlNifEnv *env, ErlNifEvent fd, enum ErlNifSelectFlags mode,
+                void *obj, const ErlNifPid *pid, term ref)
+{
+    if (fd < 0 || NULL == obj)
+        return INT_MIN | ERL_NIF_SELECT_INVALID_EVENT;
+    if (mode & ERL_NIF_SELECT_STOP)
+        return stop(env, fd, obj);
+
+    ErlNifPid to;
+    if (pid)
+        to = *pid;
+    else if (NULL == enif_self(env, &to))
+        return INT_MIN | ERL_NIF_SELECT_FAILED;
+
+    pthread_mutex_lock(&lock);
+    int result = 0;
+    bool always_ready_p = false;
+    struct selected *s = NULL;
+    if (!start_poller() || NULL == (s = selected_for(fd, obj, &always_ready_p))) {
+        if (!always_ready_p)
+            result = INT_MIN | (EBADF == errno ? ERL_NIF_SELECT_INVALID_EVENT :
+                                ERL_NIF_SELECT_FAILED);
+    }
+#ifdef ERL_NIF_SELECT_READ_CANCELLED
+    if (s && (mode & ERL_NIF_SELECT_CANCEL)) {
+        if ((mode & ERL_NIF_SELECT_READ) && s->interests[INPUT].armed_p)
+            result |= ERL_NIF_SELECT_READ_CANCELLED;
+        if ((mode & ERL_NIF_SELECT_WRITE) && s->interests[OUTPUT].armed_p)
+            result |= ERL_NIF_SELECT_WRITE_CANCELLED;
+        if (mode & ERL_NIF_SELECT_READ)
+            s->interests[INPUT].armed_p = false;
+        if (mode & ERL_NIF_SELECT_WRITE)
+            s->interests[OUTPUT].armed_p = false;
+        rearm(s);
+        pthread_mutex_unlock(&lock);
+        return result;
+    }
+#endif
+    for (int d = 0; d < N_DIRECTIONS && result >= 0; ++d) {
+        if (!(mode & (INPUT == d ? ERL_NIF_SELECT_READ : ERL_NIF_SELECT_WRITE)))
+            continue;
+        struct interest in = {.armed_p = true, .pid = to, .ref = ref};
+        if (always_ready_p) {
+            struct selected file = {.fd = fd, .obj = obj};
+            file.interests[d] = in;
+            send_ready(&file, d);
+            continue;
+        }
+        in.ref = enif_make_copy(s->env, ref);
+        s->interests[d] = in;
+    }
+    if (s && result >= 0)
+        rearm(s);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+/* Drops every registration, without calling stop callbacks, before the
+ * NIFs are unloaded. */
+void select_stop(void)
+{
+    if (!poller_started_p)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping_p = true;
+    pthread_mutex_unlock(&lock);
+    uint64_t one = 1;
+    if (sizeof(one) != write(wakeup_fd, &one, sizeof(one)))
+        abort();
+    pthread_join(poller, NULL);
+
+    for (int fd = 0; fd < by_fd_len; ++fd)
+        if (by_fd[fd])
+            enif_release_resource(forget(by_fd[fd]));
+    free(by_fd);
+    by_fd = NULL;
+    by_fd_len = 0;
+    close(wakeup_fd);
+    close(epoll_fd);
+    wakeup_fd = epoll_fd = -1;
+    poller_started_p = stopping_p = false;
+}
+
+#else
+
+int enif_select(ErlNifEnv *UNUSED, ErlNifEvent UNUSED, enum ErlNifSelectFlags UNUSED,
+                void *UNUSED, const ErlNifPid *UNUSED, term UNUSED)
+{
+    fprintf(stderr, "enif_select is only supported on Linux\n");
+    return INT_MIN | ERL_NIF_SELECT_FAILED;
+}
+
+void select_stop(void) {}
+
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "nif_stubs.h"
+
+extern void select_stop(void);
@@ -0,0 +1,126 @@
+/* Single-producer, single-consumer queues
+ *
+ * A ring of fixed-size slots that the producer fills and the consumer
+ * drains in place, so nothing is allocated once it's set up.  Each side
+ * advances only its own index and reads the other's, so passing an
+ * element is an atomic load and an atomic store on each side.
+ *
+ * A side that finds the ring full (or empty) spins for a while, then
+ * sleeps until the other side moves.  It announces that it's sleeping
+ * before its last look at the other's index, and the other side looks
+ * for sleepers after moving its own, so one of them always sees the
+ * other.
+ */
+
+#include <stdlib.h>
+
+#include "spsc.h"
+
+enum { SPINS = 1000 };
+
+
+/* The capacity must be a power of two. */
+bool spsc_init(struct spsc *q, size_t capacity, size_t elem_size)
+{
+    if (0 == capacity || 0 != (capacity & (capacity-1)))
+        return false;
+    *q = (struct spsc){.capacity = capacity, .elem_size = elem_size};
+    if (NULL == (q->slots = calloc(capacity, elem_size)))
+        return false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->progress, NULL);
+    return true;
+}
+
+
+void spsc_destroy(struct spsc *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->progress);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+
+/* For setting up and tearing down what the slots hold, while neither
+ * side is using the queue. */
+void *spsc_slot(struct spsc *q, size_t i)
+{
+    return q->slots + (i & (q->capacity-1)) * q->elem_size;
+}
+
+
+static void relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+static void wait_until(struct spsc *q, bool (*ready_p)(struct spsc *))
+{
+    for (unsigned i = 0; i < SPINS; ++i) {
+        if (ready_p(q))
+            return;
+        relax();
+    }
+    pthread_mutex_lock(&q->lock);
+    __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!ready_p(q))
+        pthread_cond_wait(&q->progress, &q->lock);
+    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+static void wake(struct spsc *q)
+{
+    if (0 == __atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->progress);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+static bool not_full_p(struct spsc *q)
+{
+    return q->tail - __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) < q->capacity;
+}
+
+
+static bool not_empty_p(struct spsc *q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != q->head;
+}
+
+
+/* The producer's next slot, once the consumer has finished with it. */
+void *spsc_claim(struct spsc *q)
+{
+    wait_until(q, not_full_p);
+    return spsc_slot(q, q->tail);
+}
+
+
+void spsc_publish(struct spsc *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+    wake(q);
+}
+
+
+/* The consumer's next slot, once the producer has filled it. */
+void *spsc_peek(struct spsc *q)
+{
+    wait_until(q, not_empty_p);
+    return spsc_slot(q, q->head);
+}
+
+
+void spsc_release(struct spsc *q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+    wake(q);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct spsc {
+    size_t capacity, elem_size;
+    char *slots;
+    /* Written only by the consumer and the producer respectively, and
+     * kept apart so they don't share a cache line. */
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+    unsigned sleepers __attribute__((aligned(64)));
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+};
+
+extern bool spsc_init(struct spsc *, size_t, size_t);
+extern void spsc_destroy(struct spsc *);
+extern void *spsc_slot(struct spsc *, size_t);
+extern void *spsc_claim(struct spsc *);
+extern void spsc_publish(struct spsc *);
+extern void *spsc_peek(struct spsc *);
+extern void spsc_release(struct spsc *);
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+
+set -eu
+
+num='[0-9.e+]+'
+
+ok_if() {
+    if "$@"; then
+        echo ok
+    else
+        echo not ok
+    fi
+}
+
+echo 1..3
+
+echo "# niffy:bench/4 returns its figures as a proplist"
+stats=$(echo 'niffy:bench(clean_nif, return_iolist_as_binary, [[<<"a">>, 1]], 100).' |
+            ./niffy -q ./t/clean_nif.so 2>/dev/null)
+echo "# $stats"
+ok_if grep -Eqx "\[\{calls,100\},\{min_ns,$num\},\{median_ns,$num\},\{p99_ns,$num\},\{max_ns,$num\},\{ns_per_call,$num\},\{calls_per_sec,$num\}\]" <<<"$stats"
+
+echo "# and badarg for arguments it can't use"
+bad=$(printf '%s\n' 'niffy:bench(clean_nif, return_ok, [], 0).' \
+                    'niffy:bench(clean_nif, return_ok, foo, 10).' \
+                    'niffy:bench(clean_nif, "return_ok", [], 10).' |
+          ./niffy -q ./t/clean_nif.so 2>/dev/null)
+ok_if diff -u <(printf 'badarg\nbadarg\nbadarg\n') - <<<"$bad"
+
+echo "# --bench prints a line for each call in the script"
+report=$(printf '%s\n' 'clean_nif:return_ok().' 'clean_nif:return_iolist_as_binary([<<"a">>]).' |
+             ./niffy -q --bench=50 ./t/clean_nif.so 2>/dev/null)
+echo "$report" | sed 's/^/# /'
+line=": 50 calls, min $num ns, median $num ns, p99 $num ns, max $num ns, $num ns/call, $num calls/s"
+ok_if diff -u <(printf 'clean_nif:return_ok/0\nclean_nif:return_iolist_as_binary/1\n') \
+              <(sed -E "s|^(clean_nif:[a-z_]+/[0-9]+)$line\$|\\1|" <<<"$report")
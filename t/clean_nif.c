@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include "erl_nif.h"
 #include "../macrology.h"
 
@@ -26,9 +27,116 @@ static ERL_NIF_TERM return_iolist_as_binary(ErlNifEnv *env, int argc, const ERL_
 }
 
 
+static ERL_NIF_TERM sub_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(3 == argc);
+    ErlNifBinary bin;
+    unsigned long pos, size;
+    if (!enif_inspect_binary(env, argv[0], &bin) ||
+        !enif_get_ulong(env, argv[1], &pos) || !enif_get_ulong(env, argv[2], &size) ||
+        pos > bin.size || size > bin.size - pos)
+        return enif_make_badarg(env);
+    return enif_make_sub_binary(env, argv[0], pos, size);
+}
+
+static ERL_NIF_TERM send_to_self(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    ErlNifPid self;
+    if (!enif_self(env, &self) || !enif_send(env, &self, NULL, argv[0]))
+        return enif_make_badarg(env);
+    return enif_make_atom(env, "ok");
+}
+
+
+/* Registered plain and dirty, to tell where each runs. */
+static ERL_NIF_TERM on_dirty_scheduler(ErlNifEnv *env, int argc, const ERL_NIF_TERM *UNUSED)
+{
+    assert(0 == argc);
+    return enif_make_atom(env, enif_is_on_dirty_scheduler(env) ? "true" : "false");
+}
+
+
+/* yield(N) runs in N segments, rescheduling itself with
+ * enif_schedule_nif after each: the third and second from last on the
+ * dirty CPU and IO schedulers.  Each adds {N, Dirty} to the list it's
+ * handed, and the last returns it. */
+static ERL_NIF_TERM yield_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(2 == argc);
+    int n;
+    if (!enif_get_int(env, argv[0], &n) || n < 0)
+        return enif_make_badarg(env);
+    if (0 == n)
+        return argv[1];
+    ERL_NIF_TERM dirty = on_dirty_scheduler(env, 0, NULL);
+    ERL_NIF_TERM next[2] = {
+        enif_make_int(env, n-1),
+        enif_make_list_cell(env, enif_make_tuple(env, 2, argv[0], dirty), argv[1])
+    };
+    int flags = 3 == n-1 ? ERL_NIF_DIRTY_JOB_CPU_BOUND :
+        2 == n-1 ? ERL_NIF_DIRTY_JOB_IO_BOUND : 0;
+    return enif_schedule_nif(env, "yield_step", flags, yield_step, 2, next);
+}
+
+
+static ERL_NIF_TERM yield(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    return yield_step(env, 2, (ERL_NIF_TERM[]){argv[0], enif_make_list(env, 0)});
+}
+
+
+/* consume_timeslice(Percent, N) reports Percent of a timeslice used, N
+ * times over, and returns how many of those reports were told the
+ * slice was used up. */
+static ERL_NIF_TERM consume_timeslice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(2 == argc);
+    int percent, n, used_up = 0;
+    if (!enif_get_int(env, argv[0], &percent) || !enif_get_int(env, argv[1], &n))
+        return enif_make_badarg(env);
+    for (int i = 0; i < n; ++i)
+        used_up += !!enif_consume_timeslice(env, percent);
+    return enif_make_int(env, used_up);
+}
+
+
+/* Makes atoms from each name in turn, copied into the same buffer,
+ * pairing each with what enif_make_existing_atom said beforehand (or
+ * false). */
+static ERL_NIF_TERM atoms_from_one_buffer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    char buf[256];
+    ERL_NIF_TERM pairs[16], list = argv[0], head;
+    unsigned n = 0;
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        ErlNifBinary bin;
+        if (n == sizeof(pairs)/sizeof(*pairs) ||
+            !enif_inspect_binary(env, head, &bin) || bin.size >= sizeof(buf))
+            return enif_make_badarg(env);
+        memcpy(buf, bin.data, bin.size);
+        buf[bin.size] = '\0';
+        ERL_NIF_TERM existing;
+        if (!enif_make_existing_atom(env, buf, &existing, ERL_NIF_LATIN1))
+            existing = enif_make_atom(env, "false");
+        pairs[n++] = enif_make_tuple(env, 2, existing, enif_make_atom(env, buf));
+    }
+    return enif_make_list_from_array(env, pairs, n);
+}
+
 
 static ErlNifFunc fns[] = {
     {"return_ok", 0, return_ok},
-    {"return_iolist_as_binary", 1, return_iolist_as_binary}
+    {"return_iolist_as_binary", 1, return_iolist_as_binary},
+    {"sub_binary", 3, sub_binary},
+    {"send_to_self", 1, send_to_self},
+    {"on_dirty_scheduler", 0, on_dirty_scheduler},
+    {"on_dirty_cpu_scheduler", 0, on_dirty_scheduler, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"on_dirty_io_scheduler", 0, on_dirty_scheduler, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"yield", 1, yield},
+    {"atoms_from_one_buffer", 1, atoms_from_one_buffer},
+    {"consume_timeslice", 2, consume_timeslice}
 };
 ERL_NIF_INIT(clean_nif, fns, &load, NULL, NULL, NULL);
@@ -2,7 +2,7 @@
 
 set -eu
 
-echo 1..1
+echo 1..2
 for i in t/iolist-*.in; do
     ./niffy -q ./t/clean_nif.so <$i 2>/dev/null | diff -u - $i.out | while read line; do
         echo "# $line"
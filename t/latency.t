@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+
+set -eu
+
+json=$(mktemp)
+trap 'rm -f "$json"' EXIT
+
+ok_if() {
+    if "$@"; then
+        echo ok
+    else
+        echo not ok
+    fi
+}
+
+# Each function's name and count of calls, and for those that
+# rescheduled, their reschedules and count of segments.
+summary() {
+    sed -E 's/^ *\{"function": "([^"]+)", "latency": \{"count": ([0-9]+),.*"reschedules": ([0-9]+), "segments": \{"count": ([0-9]+),.*/\1 \2 \3 \4/
+            s/^ *\{"function": "([^"]+)", "latency": \{"count": ([0-9]+),.*/\1 \2/' "$json" |
+        grep -v '^[][]$' | sort
+}
+
+echo 1..4
+
+echo "# --latency writes a histogram per function called, with segments of rescheduled calls"
+printf '%s\n' 'clean_nif:return_ok().' 'clean_nif:return_ok().' 'clean_nif:yield(3).' 'clean_nif:return_ok().' |
+    ./niffy -q --latency="$json" ./t/clean_nif.so >/dev/null 2>&1
+ok_if diff -u <(printf '%s\n' 'clean_nif:return_ok/0 3' 'clean_nif:yield/1 1 3 4') <(summary)
+
+echo "# each histogram has the same keys"
+keys='function latency count min_ns mean_ns p50_ns p90_ns p99_ns p999_ns p9999_ns max_ns buckets'
+ok_if diff -u <(echo "$keys") <(grep return_ok "$json" | grep -o '"[a-z0-9_]*":' | tr -d '":' | paste -sd' ')
+
+echo "# niffy:dump_latency/0 writes them as they stand"
+printf '%s\n' 'clean_nif:return_ok().' 'clean_nif:return_ok().' 'niffy:dump_latency().' 'niffy:halt().' |
+    ./niffy -q --latency="$json" ./t/clean_nif.so >/dev/null 2>&1
+ok_if diff -u <(echo 'clean_nif:return_ok/0 2') <(summary)
+
+echo "# and is badarg without --latency"
+ok_if diff -u <(echo badarg) <(echo 'niffy:dump_latency().' | ./niffy -q ./t/clean_nif.so 2>/dev/null)
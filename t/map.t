@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+
+set -eu
+
+seeds=(1 2 3)
+echo 1..${#seeds[@]}
+for seed in "${seeds[@]}"; do
+    ./map_test $seed | while read line; do
+        echo "# $line"
+    done
+    if (( PIPESTATUS[0] == 0 )); then
+        echo ok
+    else
+        echo not ok
+    fi
+done
@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+
+set -eu
+
+# --parallel=N should print what a plain run of the script does, in the
+# same order, however its statements happen to be scheduled.
+scripts=(t/iolist-*.in t/parallel-*.in t/variable-*.in)
+echo 1..${#scripts[@]}
+for i in "${scripts[@]}"; do
+    diff -u <(for n in 1 2 3 4 5; do ./niffy -q ./t/clean_nif.so <$i 2>/dev/null; done) \
+         <(./niffy -q --parallel=4 --repeat=5 ./t/clean_nif.so <$i 2>/dev/null) | while read line; do
+        echo "# $line"
+    done
+    if (( PIPESTATUS[0] == 0 )); then
+        echo ok
+    else
+        echo not ok
+    fi
+done
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+
+set -eu
+
+# Scripts read from a pipe, in the default blocks and in tiny ones that
+# cut nearly every token, should lex and parse as they do from a file.
+lex=(t/term_lex-*.in)
+parse=(t/parse-*.in)
+run=(t/iolist-*.in t/process-*.in t/variable-*.in)
+echo 1..$(( 2*${#lex[@]} + 2*${#parse[@]} + 2*${#run[@]} + 2 ))
+check() {
+    if (( (PIPESTATUS[0] | PIPESTATUS[1] | PIPESTATUS[2]) == 0 )); then
+        echo ok
+    else
+        echo not ok
+    fi
+}
+for block in "" 5; do
+    for i in "${lex[@]}"; do
+        cat $i | ./lex_test $block | diff -u - $i.out | while read line; do
+            echo "# $line"
+        done
+        check
+    done
+    for i in "${parse[@]}"; do
+        cat $i | ./parse_test $block 2>/dev/null | diff -u - $i.out | while read line; do
+            echo "# $line"
+        done
+        check
+    done
+done
+
+# And niffy should run them the same whether it parses on a thread of
+# its own or not.
+for thread in --parse-thread --no-parse-thread; do
+    for i in "${run[@]}"; do
+        cat $i | ./niffy -q $thread ./t/clean_nif.so 2>/dev/null | diff -u - $i.out | while read line; do
+            echo "# $line"
+        done
+        check
+    done
+done
+
+# niffy:halt/0 exits straight away, with what came before it printed,
+# even with the parser still going.
+for thread in --parse-thread --no-parse-thread; do
+    printf 'clean_nif:return_ok().\nniffy:halt().\nclean_nif:return_ok().\n' |
+        ./niffy -q $thread ./t/clean_nif.so 2>/dev/null | diff -u - <(echo ok) | while read line; do
+        echo "# $line"
+    done
+    check
+done
@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+
+set -eu
+
+# --repeat=N should print what N plain runs of the script do.
+scripts=(t/iolist-*.in t/process-*.in t/variable-*.in)
+echo 1..${#scripts[@]}
+for i in "${scripts[@]}"; do
+    diff -u <(for n in 1 2 3; do ./niffy -q ./t/clean_nif.so <$i 2>/dev/null; done) \
+         <(./niffy -q --repeat=3 ./t/clean_nif.so <$i 2>/dev/null) | while read line; do
+        echo "# $line"
+    done
+    if (( PIPESTATUS[0] == 0 )); then
+        echo ok
+    else
+        echo not ok
+    fi
+done
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "erl_nif.h"
+#include "../macrology.h"
+
+/* A pipe to select on: we write to one end and read from the other. */
+struct pipe {
+    int fds[2];
+    bool stopped_p;
+};
+
+static ErlNifResourceType *pipe_type;
+
+
+static void pipe_dtor(ErlNifEnv *UNUSED, void *obj)
+{
+    struct pipe *p = obj;
+    if (!p->stopped_p)
+        close(p->fds[0]);
+    close(p->fds[1]);
+}
+
+
+static void pipe_stop(ErlNifEnv *UNUSED, void *obj, ErlNifEvent fd, int UNUSED)
+{
+    struct pipe *p = obj;
+    assert(fd == p->fds[0]);
+    close(fd);
+    p->stopped_p = true;
+}
+
+
+static int load(ErlNifEnv *env, void **UNUSED, ERL_NIF_TERM UNUSED)
+{
+    ErlNifResourceTypeInit init = {.dtor = pipe_dtor, .stop = pipe_stop};
+    pipe_type = enif_open_resource_type_x(env, "pipe", &init, ERL_NIF_RT_CREATE, NULL);
+    return NULL == pipe_type;
+}
+
+
+static struct pipe *new_pipe(void)
+{
+    struct pipe *p = enif_alloc_resource(pipe_type, sizeof(*p));
+    if (NULL == p)
+        return NULL;
+    p->stopped_p = false;
+    if (0 != pipe2(p->fds, O_NONBLOCK | O_CLOEXEC)) {
+        p->fds[0] = p->fds[1] = -1;
+        enif_release_resource(p);
+        return NULL;
+    }
+    return p;
+}
+
+
+static ERL_NIF_TERM open_pipe(ErlNifEnv *env, int argc, const ERL_NIF_TERM *UNUSED)
+{
+    assert(0 == argc);
+    struct pipe *p = new_pipe();
+    if (NULL == p)
+        return enif_make_badarg(env);
+    ERL_NIF_TERM t = enif_make_resource(env, p);
+    enif_release_resource(p);
+    return t;
+}
+
+
+static ERL_NIF_TERM select_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(2 == argc);
+    struct pipe *p;
+    if (!enif_get_resource(env, argv[0], pipe_type, (void **)&p) || p->stopped_p)
+        return enif_make_badarg(env);
+    if (enif_select(env, p->fds[0], ERL_NIF_SELECT_READ, p, NULL, argv[1]) < 0)
+        return enif_make_atom(env, "error");
+    return enif_make_atom(env, "ok");
+}
+
+
+static ERL_NIF_TERM write_pipe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(2 == argc);
+    struct pipe *p;
+    ErlNifBinary bin;
+    if (!enif_get_resource(env, argv[0], pipe_type, (void **)&p) ||
+        !enif_inspect_binary(env, argv[1], &bin) ||
+        (ssize_t)bin.size != write(p->fds[1], bin.data, bin.size))
+        return enif_make_badarg(env);
+    return enif_make_atom(env, "ok");
+}
+
+
+static ERL_NIF_TERM read_pipe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    struct pipe *p;
+    uint8_t buf[64];
+    if (!enif_get_resource(env, argv[0], pipe_type, (void **)&p) || p->stopped_p)
+        return enif_make_badarg(env);
+    ssize_t n = read(p->fds[0], buf, sizeof(buf));
+    if (n < 0)
+        return enif_make_atom(env, "eagain");
+    ERL_NIF_TERM t;
+    memcpy(enif_make_new_binary(env, n, &t), buf, n);
+    return t;
+}
+
+
+static ERL_NIF_TERM stop(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    struct pipe *p;
+    if (!enif_get_resource(env, argv[0], pipe_type, (void **)&p) || p->stopped_p)
+        return enif_make_badarg(env);
+    int result = enif_select(env, p->fds[0], ERL_NIF_SELECT_STOP, p, NULL, enif_make_atom(env, "undefined"));
+    if (result < 0)
+        return enif_make_atom(env, "error");
+    return enif_make_atom(env, (result & ERL_NIF_SELECT_STOP_CALLED) ? "stop_called" : "ok");
+}
+
+
+static ERL_NIF_TERM stopped(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(1 == argc);
+    struct pipe *p;
+    if (!enif_get_resource(env, argv[0], pipe_type, (void **)&p))
+        return enif_make_badarg(env);
+    return enif_make_atom(env, p->stopped_p ? "true" : "false");
+}
+
+
+/* Selects on a pipe nothing else refers to, so the selection holds the
+ * last reference to it when it's stopped. */
+static ERL_NIF_TERM stop_last_reference(ErlNifEnv *env, int argc, const ERL_NIF_TERM *UNUSED)
+{
+    assert(0 == argc);
+    struct pipe *p = new_pipe();
+    if (NULL == p)
+        return enif_make_badarg(env);
+    ERL_NIF_TERM ref = enif_make_atom(env, "undefined");
+    if (enif_select(env, p->fds[0], ERL_NIF_SELECT_READ, p, NULL, ref) < 0) {
+        enif_release_resource(p);
+        return enif_make_atom(env, "error");
+    }
+    int fd = p->fds[0];
+    enif_release_resource(p);
+    int result = enif_select(env, fd, ERL_NIF_SELECT_STOP, p, NULL, ref);
+    if (result < 0)
+        return enif_make_atom(env, "error");
+    return enif_make_atom(env, (result & ERL_NIF_SELECT_STOP_CALLED) ? "stop_called" : "ok");
+}
+
+
+static ErlNifFunc fns[] = {
+    {"open", 0, open_pipe},
+    {"select_read", 2, select_read},
+    {"write", 2, write_pipe},
+    {"read", 1, read_pipe},
+    {"stop", 1, stop},
+    {"stopped", 1, stopped},
+    {"stop_last_reference", 0, stop_last_reference}
+};
+ERL_NIF_INIT(select_nif, fns, &load, NULL, NULL, NULL);
@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "erl_nif.h"
+#include "../macrology.h"
+
+/* count(Threads, N) starts Threads threads that each add one to a
+ * mutex-protected total and one to an rwlock-protected total N times,
+ * then tell the caller through a condition variable that they're done.
+ * Each checks its thread-specific data wasn't disturbed by the others. */
+struct counter {
+    ErlNifMutex *lock;
+    unsigned long total;
+    ErlNifRWLock *rwlock;
+    unsigned long rw_total;
+    ErlNifMutex *done_lock;
+    ErlNifCond *done;
+    unsigned n_done;
+    ErlNifTSDKey key;
+    unsigned long n;
+};
+
+struct worker {
+    struct counter *c;
+    ErlNifTid tid;
+};
+
+
+static int load(ErlNifEnv *UNUSED, void **UNUSED, ERL_NIF_TERM UNUSED) { return 0; }
+
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    struct counter *c = w->c;
+    enif_tsd_set(c->key, w);
+    for (unsigned long i = 0; i < c->n; ++i) {
+        enif_mutex_lock(c->lock);
+        ++c->total;
+        enif_mutex_unlock(c->lock);
+        enif_rwlock_rwlock(c->rwlock);
+        ++c->rw_total;
+        enif_rwlock_rwunlock(c->rwlock);
+    }
+    bool mine_p = enif_tsd_get(c->key) == w;
+
+    enif_mutex_lock(c->done_lock);
+    ++c->n_done;
+    enif_cond_signal(c->done);
+    enif_mutex_unlock(c->done_lock);
+    return mine_p ? w : NULL;
+}
+
+
+static ERL_NIF_TERM count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(2 == argc);
+    unsigned n_threads;
+    struct counter c = {0};
+    if (!enif_get_uint(env, argv[0], &n_threads) || 0 == n_threads ||
+        !enif_get_ulong(env, argv[1], &c.n))
+        return enif_make_badarg(env);
+    struct worker *workers = calloc(n_threads, sizeof(*workers));
+    if (NULL == workers)
+        return enif_make_badarg(env);
+    c.lock = enif_mutex_create("thread_nif_total");
+    c.rwlock = enif_rwlock_create("thread_nif_rw_total");
+    c.done_lock = enif_mutex_create("thread_nif_done");
+    c.done = enif_cond_create("thread_nif_done");
+    if (0 != enif_tsd_key_create("thread_nif_worker", &c.key))
+        abort();
+
+    unsigned started = 0;
+    for (; started < n_threads; ++started) {
+        workers[started].c = &c;
+        if (0 != enif_thread_create("thread_nif", &workers[started].tid, work,
+                                    &workers[started], NULL))
+            break;
+    }
+    enif_mutex_lock(c.done_lock);
+    while (c.n_done < started)
+        enif_cond_wait(c.done, c.done_lock);
+    enif_mutex_unlock(c.done_lock);
+    bool tsd_ok_p = true;
+    for (unsigned i = 0; i < started; ++i) {
+        void *result;
+        enif_thread_join(workers[i].tid, &result);
+        tsd_ok_p = tsd_ok_p && result == &workers[i];
+    }
+
+    enif_tsd_key_destroy(c.key);
+    enif_cond_destroy(c.done);
+    enif_mutex_destroy(c.done_lock);
+    enif_rwlock_destroy(c.rwlock);
+    enif_mutex_destroy(c.lock);
+    free(workers);
+    if (started < n_threads)
+        return enif_make_atom(env, "thread_create_failed");
+    if (!tsd_ok_p)
+        return enif_make_atom(env, "tsd_mismatch");
+    return enif_make_tuple(env, 2, enif_make_ulong(env, c.total),
+                           enif_make_ulong(env, c.rw_total));
+}
+
+
+static ErlNifFunc fns[] = {
+    {"count", 2, count}
+};
+ERL_NIF_INIT(thread_nif, fns, &load, NULL, NULL, NULL);
@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+
+set -eu
+
+echo 1..3
+for i in t/threads-*.in; do
+    ./niffy -q ./t/thread_nif.so <$i 2>/dev/null | diff -u - $i.out | while read line; do
+        echo "# $line"
+    done
+    if (( (PIPESTATUS[0] | PIPESTATUS[1]) == 0 )); then
+        echo ok
+    else
+        echo not ok
+    fi
+done
+
+echo "# --locks names each lock, with every acquisition counted"
+echo 'thread_nif:count(4, 10000).' | ./niffy -q --locks ./t/thread_nif.so 2>&1 >/dev/null |
+    awk '$1 != "thread_nif_done" { print $1, $2, $3 }' |
+    diff -u - <(printf '%s\n' 'lock kind acquired' \
+                              'thread_nif_rw_total rwlock 40000' \
+                              'thread_nif_total mutex 40000') | while read line; do
+    echo "# $line"
+done
+if (( (PIPESTATUS[0] | PIPESTATUS[1] | PIPESTATUS[2] | PIPESTATUS[3]) == 0 )); then
+    echo ok
+else
+    echo not ok
+fi
+
+echo "# --threads runs the script on each thread, every result as it should be"
+printf '%s\n' 'R = thread_nif:count(2, 1000).' 'assert:eq(R, {2000,2000}).' |
+    ./niffy -q --threads=4 --repeat=3 ./t/thread_nif.so 2>/dev/null |
+    awk '{ print $1, $2 }' |
+    diff -u - <(printf '%s\n' 'thread calls' '0 6' '1 6' '2 6' '3 6' 'all 24') | while read line; do
+    echo "# $line"
+done
+if (( (PIPESTATUS[0] | PIPESTATUS[1] | PIPESTATUS[2] | PIPESTATUS[3]) == 0 )); then
+    echo ok
+else
+    echo not ok
+fi
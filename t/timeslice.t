@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+
+set -eu
+
+ok_if() {
+    if "$@"; then
+        echo ok
+    else
+        echo not ok
+    fi
+}
+
+# A budget long enough that only what the NIF reports counts.
+script=(
+    'clean_nif:consume_timeslice(10, 5).'
+    'clean_nif:consume_timeslice(30, 10).'
+    'clean_nif:consume_timeslice(100, 1).'
+)
+out=$(mktemp)
+err=$(mktemp)
+trap 'rm -f "$out" "$err"' EXIT
+printf '%s\n' "${script[@]}" | ./niffy -q --timeslice=10000000 ./t/clean_nif.so >"$out" 2>"$err"
+
+echo 1..2
+
+echo "# enif_consume_timeslice says when the slice is used up"
+ok_if diff -u <(printf '0\n7\n1\n') "$out"
+
+echo "# --timeslice reports the slices used per call, and calls that overran"
+ok_if diff -u <(echo 'clean_nif:consume_timeslice/2 3 3 1.67 3 1') \
+              <(grep '^clean_nif:consume_timeslice/2 ' "$err" | tr -s ' ')
@@ -0,0 +1,429 @@
+/* Threads, locks and thread-specific data for NIFs
+ *
+ * Thin wrappers over pthreads.
+ *
+ * With lock profiling on, mutexes and rwlocks created from then on
+ * count their acquisitions, time contended waits and time how long
+ * they're held.  Statistics are kept per lock name (as passed to
+ * enif_mutex_create and friends), since a NIF with a lock per object
+ * typically gives them all the same name.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_nif.h"
+#include "histogram.h"
+#include "macrology.h"
+#include "threads.h"
+
+struct lock_stats {
+    char *name;
+    const char *kind;
+    pthread_mutex_t lock;
+    unsigned long acquisitions, contended;
+    struct histogram *wait, *hold;
+    struct lock_stats *next;
+};
+
+struct ErlDrvMutex_ {
+    pthread_mutex_t mutex;
+    struct lock_stats *stats;
+};
+
+struct ErlDrvCond_ {
+    pthread_cond_t cond;
+};
+
+struct ErlDrvRWLock_ {
+    pthread_rwlock_t rwlock;
+    struct lock_stats *stats;
+};
+
+static bool lock_profiling_p;
+static struct lock_stats *all_lock_stats;
+static pthread_mutex_t all_lock_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* When each lock this thread holds was acquired, so we can time how
+ * long it's held.  Read locks can have several holders, so this can't
+ * live in the lock. */
+enum { MAX_HELD = 16 };
+static __thread struct held {
+    void *lock;
+    uint64_t since;
+} held[MAX_HELD];
+static __thread unsigned n_held;
+
+
+void lock_profile_enable(void)
+{
+    lock_profiling_p = true;
+}
+
+
+static struct lock_stats *stats_for(const char *name, const char *kind)
+{
+    if (!lock_profiling_p)
+        return NULL;
+    if (NULL == name)
+        name = "(unnamed)";
+    pthread_mutex_lock(&all_lock_stats_lock);
+    struct lock_stats *s = all_lock_stats;
+    while (s && (0 != strcmp(s->name, name) || s->kind != kind))
+        s = s->next;
+    if (NULL == s && NULL != (s = calloc(1, sizeof(*s)))) {
+        s->name = strdup(name);
+        s->kind = kind;
+        pthread_mutex_init(&s->lock, NULL);
+        s->next = all_lock_stats;
+        all_lock_stats = s;
+    }
+    pthread_mutex_unlock(&all_lock_stats_lock);
+    return s;
+}
+
+
+static void acquired(struct lock_stats *s, void *lock, uint64_t wait_start)
+{
+    uint64_t now = monotonic_ns();
+    pthread_mutex_lock(&s->lock);
+    ++s->acquisitions;
+    if (wait_start) {
+        ++s->contended;
+        histogram_record(&s->wait, now - wait_start);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (n_held < MAX_HELD)
+        held[n_held++] = (struct held){.lock = lock, .since = now};
+}
+
+
+static void releasing(struct lock_stats *s, void *lock)
+{
+    uint64_t now = monotonic_ns();
+    for (unsigned i = n_held; i-- > 0;) {
+        if (held[i].lock != lock)
+            continue;
+        uint64_t since = held[i].since;
+        held[i] = held[--n_held];
+        pthread_mutex_lock(&s->lock);
+        histogram_record(&s->hold, now - since);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+}
+
+
+void lock_profile_report(FILE *out)
+{
+    pthread_mutex_lock(&all_lock_stats_lock);
+    if (all_lock_stats)
+        fprintf(out, "%-32s %-6s %12s %12s %10s %10s %10s %10s %10s %10s\n",
+                "lock", "kind", "acquired", "contended", "wait p50", "wait p99",
+                "wait max", "hold p50", "hold p99", "hold max");
+    for (struct lock_stats *s = all_lock_stats; s; s = s->next) {
+        void column(const struct histogram *h, double p) {
+            fprintf(out, " %10llu", (unsigned long long)
+                    (NULL == h ? 0 : p < 100 ? histogram_percentile(h, p) : h->max));
+        }
+        fprintf(out, "%-32s %-6s %12lu %12lu", s->name, s->kind,
+                s->acquisitions, s->contended);
+        column(s->wait, 50);
+        column(s->wait, 99);
+        column(s->wait, 100);
+        column(s->hold, 50);
+        column(s->hold, 99);
+        column(s->hold, 100);
+        fputc('\n', out);
+    }
+    pthread_mutex_unlock(&all_lock_stats_lock);
+}
+
+
+void lock_profile_destroy(void)
+{
+    pthread_mutex_lock(&all_lock_stats_lock);
+    for (struct lock_stats *s = all_lock_stats, *next; s; s = next) {
+        next = s->next;
+        pthread_mutex_destroy(&s->lock);
+        free(s->wait);
+        free(s->hold);
+        free(s->name);
+        free(s);
+    }
+    all_lock_stats = NULL;
+    lock_profiling_p = false;
+    pthread_mutex_unlock(&all_lock_stats_lock);
+}
+
+
+ErlNifMutex *enif_mutex_create(char *name)
+{
+    ErlNifMutex *m = malloc(sizeof(*m));
+    if (NULL == m)
+        return NULL;
+    if (0 != pthread_mutex_init(&m->mutex, NULL)) {
+        free(m);
+        return NULL;
+    }
+    m->stats = stats_for(name, "mutex");
+    return m;
+}
+
+
+void enif_mutex_destroy(ErlNifMutex *m)
+{
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+}
+
+
+int enif_mutex_trylock(ErlNifMutex *m)
+{
+    int err = pthread_mutex_trylock(&m->mutex);
+    if (0 == err && m->stats)
+        acquired(m->stats, m, 0);
+    return err;
+}
+
+
+void enif_mutex_lock(ErlNifMutex *m)
+{
+    if (NULL == m->stats) {
+        pthread_mutex_lock(&m->mutex);
+        return;
+    }
+    uint64_t wait_start = 0;
+    if (0 != pthread_mutex_trylock(&m->mutex)) {
+        wait_start = monotonic_ns();
+        pthread_mutex_lock(&m->mutex);
+    }
+    acquired(m->stats, m, wait_start);
+}
+
+
+void enif_mutex_unlock(ErlNifMutex *m)
+{
+    if (m->stats)
+        releasing(m->stats, m);
+    pthread_mutex_unlock(&m->mutex);
+}
+
+
+ErlNifCond *enif_cond_create(char *UNUSED)
+{
+    ErlNifCond *c = malloc(sizeof(*c));
+    if (NULL == c)
+        return NULL;
+    if (0 != pthread_cond_init(&c->cond, NULL)) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+
+void enif_cond_destroy(ErlNifCond *c)
+{
+    pthread_cond_destroy(&c->cond);
+    free(c);
+}
+
+
+void enif_cond_signal(ErlNifCond *c)
+{
+    pthread_cond_signal(&c->cond);
+}
+
+
+void enif_cond_broadcast(ErlNifCond *c)
+{
+    pthread_cond_broadcast(&c->cond);
+}
+
+
+/* Waiting ends the mutex's hold, and being woken starts a new one,
+ * but it doesn't count as an acquisition. */
+void enif_cond_wait(ErlNifCond *c, ErlNifMutex *m)
+{
+    if (m->stats)
+        releasing(m->stats, m);
+    pthread_cond_wait(&c->cond, &m->mutex);
+    if (m->stats && n_held < MAX_HELD)
+        held[n_held++] = (struct held){.lock = m, .since = monotonic_ns()};
+}
+
+
+ErlNifRWLock *enif_rwlock_create(char *name)
+{
+    ErlNifRWLock *l = malloc(sizeof(*l));
+    if (NULL == l)
+        return NULL;
+    if (0 != pthread_rwlock_init(&l->rwlock, NULL)) {
+        free(l);
+        return NULL;
+    }
+    l->stats = stats_for(name, "rwlock");
+    return l;
+}
+
+
+void enif_rwlock_destroy(ErlNifRWLock *l)
+{
+    pthread_rwlock_destroy(&l->rwlock);
+    free(l);
+}
+
+
+int enif_rwlock_tryrlock(ErlNifRWLock *l)
+{
+    int err = pthread_rwlock_tryrdlock(&l->rwlock);
+    if (0 == err && l->stats)
+        acquired(l->stats, l, 0);
+    return err;
+}
+
+
+void enif_rwlock_rlock(ErlNifRWLock *l)
+{
+    if (NULL == l->stats) {
+        pthread_rwlock_rdlock(&l->rwlock);
+        return;
+    }
+    uint64_t wait_start = 0;
+    if (0 != pthread_rwlock_tryrdlock(&l->rwlock)) {
+        wait_start = monotonic_ns();
+        pthread_rwlock_rdlock(&l->rwlock);
+    }
+    acquired(l->stats, l, wait_start);
+}
+
+
+void enif_rwlock_runlock(ErlNifRWLock *l)
+{
+    if (l->stats)
+        releasing(l->stats, l);
+    pthread_rwlock_unlock(&l->rwlock);
+}
+
+
+int enif_rwlock_tryrwlock(ErlNifRWLock *l)
+{
+    int err = pthread_rwlock_trywrlock(&l->rwlock);
+    if (0 == err && l->stats)
+        acquired(l->stats, l, 0);
+    return err;
+}
+
+
+void enif_rwlock_rwlock(ErlNifRWLock *l)
+{
+    if (NULL == l->stats) {
+        pthread_rwlock_wrlock(&l->rwlock);
+        return;
+    }
+    uint64_t wait_start = 0;
+    if (0 != pthread_rwlock_trywrlock(&l->rwlock)) {
+        wait_start = monotonic_ns();
+        pthread_rwlock_wrlock(&l->rwlock);
+    }
+    acquired(l->stats, l, wait_start);
+}
+
+
+void enif_rwlock_rwunlock(ErlNifRWLock *l)
+{
+    if (l->stats)
+        releasing(l->stats, l);
+    pthread_rwlock_unlock(&l->rwlock);
+}
+
+
+int enif_tsd_key_create(char *UNUSED, ErlNifTSDKey *key)
+{
+    pthread_key_t k;
+    int err = pthread_key_create(&k, NULL);
+    if (0 == err)
+        *key = k;
+    return err;
+}
+
+
+void enif_tsd_key_destroy(ErlNifTSDKey key)
+{
+    pthread_key_delete(key);
+}
+
+
+void enif_tsd_set(ErlNifTSDKey key, void *data)
+{
+    pthread_setspecific(key, data);
+}
+
+
+void *enif_tsd_get(ErlNifTSDKey key)
+{
+    return pthread_getspecific(key);
+}
+
+
+ErlNifThreadOpts *enif_thread_opts_create(char *UNUSED)
+{
+    ErlNifThreadOpts *opts = malloc(sizeof(*opts));
+    if (opts)
+        opts->suggested_stack_size = -1;
+    return opts;
+}
+
+
+void enif_thread_opts_destroy(ErlNifThreadOpts *opts)
+{
+    free(opts);
+}
+
+
+/* As in ERTS, the suggested stack size is in kilowords. */
+int enif_thread_create(char *UNUSED, ErlNifTid *tid, void *(*f)(void *),
+                       void *arg, ErlNifThreadOpts *opts)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err = pthread_attr_init(&attr);
+    if (err)
+        return err;
+    if (opts && opts->suggested_stack_size > 0) {
+        size_t size = (size_t)opts->suggested_stack_size * 1024 * sizeof(void *);
+        pthread_attr_setstacksize(&attr, size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : size);
+    }
+    err = pthread_create(&thread, &attr, f, arg);
+    pthread_attr_destroy(&attr);
+    if (0 == err)
+        *tid = (ErlNifTid)thread;
+    return err;
+}
+
+
+ErlNifTid enif_thread_self(void)
+{
+    return (ErlNifTid)pthread_self();
+}
+
+
+int enif_equal_tids(ErlNifTid a, ErlNifTid b)
+{
+    return pthread_equal((pthread_t)a, (pthread_t)b);
+}
+
+
+void enif_thread_exit(void *result)
+{
+    pthread_exit(result);
+}
+
+
+int enif_thread_join(ErlNifTid tid, void **result)
+{
+    return pthread_join((pthread_t)tid, result);
+}
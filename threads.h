@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdio.h>
+
+extern void lock_profile_enable(void);
+extern void lock_profile_report(FILE *);
+extern void lock_profile_destroy(void);
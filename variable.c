@@ -1,17 +1,41 @@
+/* Variable bindings
+ *
+ * Bound values are copied into a heap of their own, so they outlive
+ * the statement that produced them.  Rebinding leaves the old value
+ * behind as garbage; once enough has built up, variable_gc copies the
+ * live bindings into a fresh heap and drops the old one.
+ */
 
 #include <stdio.h>
 
+#include "macrology.h"
 #include "map.h"
 #include "str.h"
 #include "variable.h"
 
 
 static struct atom_ptr_map map;
+static ErlNifEnv *heap;
+static atom underscore;
+/* What the heap held just after the last collection; we collect again
+ * once it has grown well past that. */
+static size_t live_after_gc;
+static bool garbage_p;
+
+enum { MIN_GC_HEAP_SIZE = 1<<16 };
 
 
 bool variable_assign(atom k, term v)
 {
-    return map_insert(&map, k, (void *)v);
+    if (!underscore)
+        underscore = intern_cstr("_");
+    if (k == underscore)
+        return true;
+    if (NULL == heap && NULL == (heap = enif_alloc_env()))
+        return false;
+    if (map_lookup(&map, k))
+        garbage_p = true;
+    return map_insert(&map, k, (void *)enif_make_copy(heap, v));
 }
 
 
@@ -19,3 +43,78 @@ term variable_lookup(atom k)
 {
     return (term)map_lookup(&map, k);
 }
+
+
+static term lookup_variable(void *UNUSED, term v)
+{
+    return variable_lookup(variable_untagged(v));
+}
+
+
+/* Parsed terms refer to variables by name; this fills in their
+ * current values. */
+term variable_substitute(ErlNifEnv *env, term t)
+{
+    return substitute_variables(env, t, lookup_variable, NULL);
+}
+
+
+/* Whether a bindings heap that has grown to used bytes, and held
+ * live_after_gc just after it was last collected, is worth collecting
+ * again: only once it's grown to twice that. */
+bool variable_gc_due_p(size_t used, size_t live_after_gc)
+{
+    return used >= MIN_GC_HEAP_SIZE && used >= 2*live_after_gc;
+}
+
+
+/* Where variable_gc is copying the live bindings to; map_iter takes
+ * no context, so copy_binding finds it here. */
+static ErlNifEnv *gc_to;
+static struct atom_ptr_map gc_copied;
+static bool gc_ok;
+
+
+static void copy_binding(struct atom_ptr_pair p)
+{
+    gc_ok = gc_ok && map_insert(&gc_copied, p.k, (void *)enif_make_copy(gc_to, (term)p.v));
+}
+
+
+/* Must only be called between statements: it invalidates every term
+ * previously returned by variable_lookup. */
+void variable_gc(void)
+{
+    if (!garbage_p || !variable_gc_due_p(arena_used(&heap->heap), live_after_gc))
+        return;
+
+    gc_to = enif_alloc_env();
+    if (NULL == gc_to)
+        return;
+    gc_copied = (struct atom_ptr_map){0};
+    gc_ok = true;
+    map_iter(&map, copy_binding);
+    if (!gc_ok) {
+        map_destroy(&gc_copied);
+        enif_free_env(gc_to);
+        return;
+    }
+
+    map_destroy(&map);
+    map = gc_copied;
+    enif_free_env(heap);
+    heap = gc_to;
+    live_after_gc = arena_used(&heap->heap);
+    garbage_p = false;
+}
+
+
+void variable_destroy(void)
+{
+    map_destroy(&map);
+    if (heap)
+        enif_free_env(heap);
+    heap = NULL;
+    live_after_gc = 0;
+    garbage_p = false;
+}
@@ -5,3 +5,7 @@
 
 extern bool variable_assign(atom, term);
 extern term variable_lookup(atom);
+extern term variable_substitute(ErlNifEnv *, term);
+extern bool variable_gc_due_p(size_t, size_t);
+extern void variable_gc(void);
+extern void variable_destroy(void);